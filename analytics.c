@@ -0,0 +1,343 @@
+#include "analytics.h"
+#include "c37.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* An analytics stage keeps rolling statistics over the last few data
+ * frames of a stream, and raises an alarm whenever one crosses its limit.
+ * It is driven by a comma-separated spec of any of:
+ *
+ *	window:N	frames to keep statistics over [default = 32]
+ *	vrms:LO:HI	limits on the RMS voltage amplitude
+ *	fnom:F		nominal frequency in Hz [default = 60]
+ *	fdev:D		limit on how far frequency strays from nominal, in Hz
+ *	angle:A		limit on how far the current angle swings, in degrees
+ *
+ * The window is kept as one array per quantity, rounded up to a whole
+ * number of vectors, and each frame's statistics are computed over the
+ * whole window with vector arithmetic.  Statistics wait until the window
+ * has filled.  Only single-PMU data frames are analyzed, and those flagged
+ * invalid are left out.
+ *
+ * Alarms go out one line each, tab-separated, when raised and cleared:
+ *
+ *	name kind state time value limit
+ */
+
+#define LANES	4
+
+typedef float vfloat __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t vint __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+enum {
+	ALARM_VRMS_LOW,
+	ALARM_VRMS_HIGH,
+	ALARM_FDEV,
+	ALARM_ANGLE,
+	ALARMS,
+};
+
+static const char *const alarm_names[ALARMS] = {
+	"vrms-low", "vrms-high", "fdev", "angle",
+};
+
+struct analytics {
+	char *name;
+	FILE *alarms;
+	struct analytics_stats *stats;
+	double limits[ALARMS];
+	int enabled[ALARMS];
+	float fnom;
+
+	/* The window, oldest sample overwritten first.
+	 */
+	size_t size;
+	size_t next;
+	size_t filled;
+	float *amplitude;
+	float *frequency;
+	float *angle;
+};
+
+struct summary {
+	float vrms;
+	float fdev;
+	float swing;
+};
+
+static void count(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static int parse_spec(struct analytics *a, const char *spec)
+{
+	char *copy;
+	char *item;
+	char *save;
+	char *end;
+	double lo;
+	double hi;
+	long n;
+
+	a->size = 32;
+	a->fnom = 60;
+
+	copy = strdup(spec);
+	if (!copy)
+		return -1;
+
+	for (item = strtok_r(copy, ",", &save); item;
+	     item = strtok_r(NULL, ",", &save)) {
+		if (!strncmp(item, "window:", 7)) {
+			n = strtol(&item[7], &end, 10);
+			if (*end || n <= 0 || n > 65536)
+				goto fail;
+			a->size = (n + LANES - 1) / LANES * LANES;
+		} else if (!strncmp(item, "vrms:", 5)) {
+			lo = strtod(&item[5], &end);
+			if (*end != ':')
+				goto fail;
+			hi = strtod(&end[1], &end);
+			if (*end || lo < 0 || hi <= lo)
+				goto fail;
+			a->limits[ALARM_VRMS_LOW] = lo;
+			a->limits[ALARM_VRMS_HIGH] = hi;
+			a->enabled[ALARM_VRMS_LOW] = lo > 0;
+			a->enabled[ALARM_VRMS_HIGH] = 1;
+		} else if (!strncmp(item, "fnom:", 5)) {
+			a->fnom = strtod(&item[5], &end);
+			if (*end || a->fnom <= 0)
+				goto fail;
+		} else if (!strncmp(item, "fdev:", 5)) {
+			a->limits[ALARM_FDEV] = strtod(&item[5], &end);
+			if (*end || a->limits[ALARM_FDEV] <= 0)
+				goto fail;
+			a->enabled[ALARM_FDEV] = 1;
+		} else if (!strncmp(item, "angle:", 6)) {
+			a->limits[ALARM_ANGLE] = strtod(&item[6], &end);
+			if (*end || a->limits[ALARM_ANGLE] <= 0)
+				goto fail;
+			a->enabled[ALARM_ANGLE] = 1;
+		} else {
+			goto fail;
+		}
+	}
+
+	free(copy);
+	return 0;
+
+fail:
+	free(copy);
+	return -1;
+}
+
+int analytics_spec_valid(const char *spec)
+{
+	struct analytics a;
+
+	memset(&a, 0, sizeof(a));
+	return parse_spec(&a, spec) == 0;
+}
+
+static float *window_array(size_t size)
+{
+	void *p;
+
+	if (posix_memalign(&p, sizeof(vfloat), size * sizeof(float)))
+		return NULL;
+	return p;
+}
+
+struct analytics *analytics_start(const char *spec, const char *name,
+				  FILE *alarms, struct analytics_stats *stats)
+{
+	struct analytics *a;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+
+	if (parse_spec(a, spec) < 0) {
+		free(a);
+		return NULL;
+	}
+
+	a->name = strdup(name);
+	a->amplitude = window_array(a->size);
+	a->frequency = window_array(a->size);
+	a->angle = window_array(a->size);
+	if (!a->name || !a->amplitude || !a->frequency || !a->angle) {
+		analytics_stop(a);
+		return NULL;
+	}
+
+	a->alarms = alarms;
+	a->stats = stats;
+	return a;
+}
+
+static vfloat splat(float x)
+{
+	vfloat v = { x, x, x, x };
+
+	return v;
+}
+
+/* Picks a where the mask is set, and b elsewhere.
+ */
+static vfloat choose(vint mask, vfloat a, vfloat b)
+{
+	return (vfloat)(((vint)a & mask) | ((vint)b & ~mask));
+}
+
+/* Computes the statistics of a full window.  The current angle swing is
+ * taken relative to the newest sample, wrapped into +/-pi, so that it is
+ * not thrown off by angles wrapping around.
+ */
+static void summarize(struct analytics *a, float newest, struct summary *s)
+{
+	const vfloat pi = splat(M_PI);
+	const vfloat twopi = splat(2 * M_PI);
+	const vfloat fnom = splat(a->fnom);
+	const vfloat ref = splat(newest);
+	const vint absmask = { 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF };
+	vfloat sumsq = splat(0);
+	vfloat fdev = splat(0);
+	vfloat lo = splat(0);
+	vfloat hi = splat(0);
+	vfloat v;
+	vfloat f;
+	vfloat d;
+	size_t i;
+	int lane;
+
+	for (i = 0; i < a->size; i += LANES) {
+		v = *(vfloat *)&a->amplitude[i];
+		sumsq += v * v;
+
+		f = *(vfloat *)&a->frequency[i] - fnom;
+		f = (vfloat)((vint)f & absmask);
+		fdev = choose(f > fdev, f, fdev);
+
+		d = *(vfloat *)&a->angle[i] - ref;
+		d -= (vfloat)((vint)twopi & (d > pi));
+		d += (vfloat)((vint)twopi & (d < -pi));
+		lo = choose(d < lo, d, lo);
+		hi = choose(d > hi, d, hi);
+	}
+
+	s->vrms = 0;
+	s->fdev = 0;
+	s->swing = 0;
+	for (lane = 0; lane < LANES; lane++) {
+		s->vrms += sumsq[lane];
+		if (fdev[lane] > s->fdev)
+			s->fdev = fdev[lane];
+		if (hi[lane] - lo[lane] > s->swing)
+			s->swing = hi[lane] - lo[lane];
+	}
+	s->vrms = sqrtf(s->vrms / a->size);
+	s->swing = s->swing * 180 / M_PI;
+}
+
+static void set_alarm(struct analytics *a, int kind, int on, double value,
+		      c37_packet *pkt)
+{
+	struct analytics_stats *stats = a->stats;
+	unsigned long long bit = 1ULL << kind;
+	unsigned long long frac = pkt->fracsec & 0xFFFFFF;
+
+	if (!!(stats->active & bit) == on)
+		return;
+
+	__atomic_store_n(&stats->active, stats->active ^ bit,
+			 __ATOMIC_RELAXED);
+	if (on)
+		count(&stats->alarms, 1);
+
+	if (a->alarms)
+		fprintf(a->alarms, "%s\t%s\t%s\t%u.%06llu\t%g\t%g\n", a->name,
+			alarm_names[kind], on ? "raised" : "cleared",
+			(unsigned int)pkt->soc, frac * 1000000 / TIME_BASE,
+			value, a->limits[kind]);
+}
+
+void analytics_frame(struct analytics *a, char *frame, size_t size)
+{
+	struct summary s;
+	c37_packet pkt;
+
+	if (size != FRAME_SIZE || !c37_is_data(frame))
+		return;
+
+	parse_c37_packet(&pkt, frame);
+	if (pkt.stat & 0x8000)
+		return;
+	a->amplitude[a->next] = pkt.voltage_amplitude;
+	a->frequency[a->next] = pkt.voltage_frequency;
+	a->angle[a->next] = pkt.current_angle;
+	a->next = (a->next + 1) % a->size;
+	count(&a->stats->frames, 1);
+
+	if (a->filled < a->size) {
+		a->filled++;
+		if (a->filled < a->size)
+			return;
+	}
+
+	summarize(a, pkt.current_angle, &s);
+	if (a->enabled[ALARM_VRMS_LOW])
+		set_alarm(a, ALARM_VRMS_LOW,
+			  s.vrms < a->limits[ALARM_VRMS_LOW], s.vrms, &pkt);
+	if (a->enabled[ALARM_VRMS_HIGH])
+		set_alarm(a, ALARM_VRMS_HIGH,
+			  s.vrms > a->limits[ALARM_VRMS_HIGH], s.vrms, &pkt);
+	if (a->enabled[ALARM_FDEV])
+		set_alarm(a, ALARM_FDEV, s.fdev > a->limits[ALARM_FDEV],
+			  s.fdev, &pkt);
+	if (a->enabled[ALARM_ANGLE])
+		set_alarm(a, ALARM_ANGLE, s.swing > a->limits[ALARM_ANGLE],
+			  s.swing, &pkt);
+}
+
+void analytics_stop(struct analytics *a)
+{
+	if (a->alarms)
+		fflush(a->alarms);
+	free(a->name);
+	free(a->amplitude);
+	free(a->frequency);
+	free(a->angle);
+	free(a);
+}
+
+static unsigned long long sample(unsigned long long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void analytics_add(struct analytics_stats *total,
+		   struct analytics_stats *stats)
+{
+	total->frames += sample(&stats->frames);
+	total->alarms += sample(&stats->alarms);
+	total->active |= sample(&stats->active);
+}
+
+void analytics_report(struct analytics_stats *stats, const char *name,
+		      FILE *output)
+{
+	unsigned long long active = sample(&stats->active);
+	int i;
+
+	fprintf(output, "analytics %s: %llu frames, %llu alarms raised",
+		name, sample(&stats->frames), sample(&stats->alarms));
+	for (i = 0; i < ALARMS; i++)
+		if (active & (1ULL << i))
+			fprintf(output, ", %s", alarm_names[i]);
+	fprintf(output, "\n");
+}
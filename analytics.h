@@ -0,0 +1,28 @@
+#ifndef ANALYTICS_H
+#define ANALYTICS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Written only by the stage's owner; others read with relaxed atomics.
+ */
+struct analytics_stats {
+	unsigned long long frames;
+	unsigned long long alarms;
+	unsigned long long active;
+};
+
+struct analytics;
+
+int analytics_spec_valid(const char *spec);
+struct analytics *analytics_start(const char *spec, const char *name,
+				  FILE *alarms, struct analytics_stats *stats);
+void analytics_frame(struct analytics *a, char *frame, size_t size);
+void analytics_stop(struct analytics *a);
+
+void analytics_add(struct analytics_stats *total,
+		   struct analytics_stats *stats);
+void analytics_report(struct analytics_stats *stats, const char *name,
+		      FILE *output);
+
+#endif
@@ -0,0 +1,280 @@
+#include "bufpool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* A buffer pool hands out I/O buffers in a few size classes, so that a
+ * stream need hold a buffer only while it has data in flight, and only as
+ * large as that data.  Each thread borrows through its own cache, which
+ * trades buffers with the shared pool in batches; the pool's lock is taken
+ * only when a cache runs dry or overflows.  A buffer may be returned
+ * through a different cache from the one it came out of.  Buffers are
+ * never given back to the system until the pool stops; the high-water
+ * mark counts those that were out in the caches at once.
+ */
+
+#define BUFPOOL_CLASSES	6
+#define CACHE_MAX	32
+#define CACHE_BATCH	16
+
+static const size_t class_size[BUFPOOL_CLASSES] = {
+	64, 256, 1024, 4096, 16384, 65536,
+};
+
+/* Precedes every buffer; keeps the buffer itself 16-byte aligned.
+ */
+struct bufhdr {
+	struct bufhdr *next;
+	size_t class;
+};
+
+struct bufclass {
+	struct bufhdr *free;
+	unsigned long long allocated;
+	unsigned long long out;
+	unsigned long long peak;
+};
+
+struct bufpool {
+	pthread_mutex_t lock;
+	struct bufclass classes[BUFPOOL_CLASSES];
+	struct bufcache *caches;
+	long long orphans[BUFPOOL_CLASSES];
+	unsigned long long bytes;
+	unsigned long long outbytes;
+	unsigned long long peakbytes;
+};
+
+/* In-use counts are written only by the cache's thread, and may go
+ * negative in a cache that takes back more buffers than it lent.
+ */
+struct bufcache {
+	struct bufpool *pool;
+	struct bufcache *next;
+	struct bufhdr *free[BUFPOOL_CLASSES];
+	int nfree[BUFPOOL_CLASSES];
+	long long inuse[BUFPOOL_CLASSES];
+};
+
+struct bufpool *bufpool_start(void)
+{
+	struct bufpool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+	return pool;
+}
+
+struct bufcache *bufcache_start(struct bufpool *pool)
+{
+	struct bufcache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->pool = pool;
+
+	pthread_mutex_lock(&pool->lock);
+	cache->next = pool->caches;
+	pool->caches = cache;
+	pthread_mutex_unlock(&pool->lock);
+	return cache;
+}
+
+size_t buffer_size(char *buffer)
+{
+	struct bufhdr *b = (struct bufhdr *)buffer - 1;
+
+	return class_size[b->class];
+}
+
+/* Called with the lock held whenever buffers go out to a cache or come
+ * back from one.
+ */
+static void lend(struct bufpool *pool, int c, long long n)
+{
+	struct bufclass *class = &pool->classes[c];
+
+	class->out += n;
+	if (class->out > class->peak)
+		class->peak = class->out;
+	pool->outbytes += n * class_size[c];
+	if (pool->outbytes > pool->peakbytes)
+		pool->peakbytes = pool->outbytes;
+}
+
+/* Takes a batch of buffers from the pool, or makes one if it has none.
+ */
+static int refill(struct bufcache *cache, int c)
+{
+	struct bufpool *pool = cache->pool;
+	struct bufclass *class = &pool->classes[c];
+	struct bufhdr *b;
+	int n;
+
+	pthread_mutex_lock(&pool->lock);
+	for (n = 0; n < CACHE_BATCH && class->free; n++) {
+		b = class->free;
+		class->free = b->next;
+		b->next = cache->free[c];
+		cache->free[c] = b;
+		cache->nfree[c]++;
+	}
+	if (n)
+		lend(pool, c, n);
+	pthread_mutex_unlock(&pool->lock);
+	if (n)
+		return 0;
+
+	b = malloc(sizeof(*b) + class_size[c]);
+	if (!b)
+		return -1;
+	b->class = c;
+	b->next = NULL;
+	cache->free[c] = b;
+	cache->nfree[c]++;
+
+	pthread_mutex_lock(&pool->lock);
+	class->allocated++;
+	pool->bytes += class_size[c];
+	lend(pool, c, 1);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+/* Returns up to n of the cache's free buffers of a class to the pool.
+ */
+static void flush(struct bufcache *cache, int c, int n)
+{
+	struct bufpool *pool = cache->pool;
+	struct bufclass *class = &pool->classes[c];
+	struct bufhdr *b;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < n && cache->free[c]; i++) {
+		b = cache->free[c];
+		cache->free[c] = b->next;
+		cache->nfree[c]--;
+		b->next = class->free;
+		class->free = b;
+	}
+	lend(pool, c, -i);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Returns a buffer of at least the given size, which buffer_size() tells
+ * exactly.
+ */
+char *bufcache_get(struct bufcache *cache, size_t size)
+{
+	struct bufhdr *b;
+	int c;
+
+	for (c = 0; c < BUFPOOL_CLASSES && class_size[c] < size; c++)
+		;
+	if (c == BUFPOOL_CLASSES) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!cache->free[c] && refill(cache, c) < 0)
+		return NULL;
+
+	b = cache->free[c];
+	cache->free[c] = b->next;
+	cache->nfree[c]--;
+	__atomic_store_n(&cache->inuse[c], cache->inuse[c] + 1,
+			 __ATOMIC_RELAXED);
+	return (char *)(b + 1);
+}
+
+void bufcache_put(struct bufcache *cache, char *buffer)
+{
+	struct bufhdr *b;
+	int c;
+
+	if (!buffer)
+		return;
+
+	b = (struct bufhdr *)buffer - 1;
+	c = b->class;
+	b->next = cache->free[c];
+	cache->free[c] = b;
+	cache->nfree[c]++;
+	__atomic_store_n(&cache->inuse[c], cache->inuse[c] - 1,
+			 __ATOMIC_RELAXED);
+
+	if (cache->nfree[c] > CACHE_MAX)
+		flush(cache, c, CACHE_BATCH);
+}
+
+void bufcache_stop(struct bufcache *cache)
+{
+	struct bufpool *pool = cache->pool;
+	struct bufcache **p;
+	int c;
+
+	for (c = 0; c < BUFPOOL_CLASSES; c++)
+		flush(cache, c, cache->nfree[c]);
+
+	/* Whatever the cache still has lent out stays on the pool's books.
+	 */
+	pthread_mutex_lock(&pool->lock);
+	for (p = &pool->caches; *p != cache; p = &(*p)->next)
+		;
+	*p = cache->next;
+	for (c = 0; c < BUFPOOL_CLASSES; c++)
+		pool->orphans[c] += cache->inuse[c];
+	pthread_mutex_unlock(&pool->lock);
+
+	free(cache);
+}
+
+void bufpool_report(struct bufpool *pool, FILE *output)
+{
+	struct bufclass *class;
+	struct bufcache *cache;
+	long long inuse;
+	int c;
+
+	pthread_mutex_lock(&pool->lock);
+	for (c = 0; c < BUFPOOL_CLASSES; c++) {
+		class = &pool->classes[c];
+		if (!class->peak)
+			continue;
+
+		inuse = pool->orphans[c];
+		for (cache = pool->caches; cache; cache = cache->next)
+			inuse += __atomic_load_n(&cache->inuse[c],
+						 __ATOMIC_RELAXED);
+		fprintf(output, "buffers %zu: %lld in use, %llu allocated, "
+			"%llu high-water\n", class_size[c], inuse,
+			class->allocated, class->peak);
+	}
+	fprintf(output, "buffers: %llu bytes allocated, %llu bytes "
+		"high-water\n", pool->bytes, pool->peakbytes);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Every cache must have stopped, and every buffer come back.
+ */
+void bufpool_stop(struct bufpool *pool)
+{
+	struct bufhdr *b;
+	int c;
+
+	for (c = 0; c < BUFPOOL_CLASSES; c++) {
+		while ((b = pool->classes[c].free)) {
+			pool->classes[c].free = b->next;
+			free(b);
+		}
+	}
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
@@ -0,0 +1,20 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdio.h>
+
+struct bufpool;
+struct bufcache;
+
+struct bufpool *bufpool_start(void);
+void bufpool_report(struct bufpool *pool, FILE *output);
+void bufpool_stop(struct bufpool *pool);
+
+struct bufcache *bufcache_start(struct bufpool *pool);
+char *bufcache_get(struct bufcache *cache, size_t size);
+void bufcache_put(struct bufcache *cache, char *buffer);
+void bufcache_stop(struct bufcache *cache);
+
+size_t buffer_size(char *buffer);
+
+#endif
@@ -29,17 +29,41 @@ char *put_big_endian(char *ptr, int size, unsigned char *data) {
 	return ptr;
 }
 
-c37_packet *get_c37_packet(char *data) {
-    c37_packet *pkt = malloc(sizeof(c37_packet));
-	if (pkt == 0) {
+/* Returns the size of the frame at the start of data, 0 if more data is
+ * needed to tell, or -1 if data does not start with a C37.118 frame.
+ */
+int c37_frame_size(char *data, size_t length) {
+	uint16_t framesize;
+
+	if (length < 1)
 		return 0;
-	}
+	if ((unsigned char)data[0] != 0xAA)
+		return -1;
+	if (length < 4)
+		return 0;
+
+	get_big_endian(&data[2], 2, (unsigned char *) &framesize);
+	if (framesize < HEADER_SIZE + CRC_SIZE)
+		return -1;
+	return framesize;
+}
+
+/* Data frames have frame type 0 in bits 6-4 of the second sync byte.
+ */
+int c37_is_data(char *data) {
+	return ((unsigned char)data[1] & 0x70) == 0;
+}
 
+char *parse_c37_header(c37_packet *pkt, char *data) {
     data = get_big_endian(data, 2, (unsigned char *) &pkt->sync);
     data = get_big_endian(data, 2, (unsigned char *) &pkt->framesize);
     data = get_big_endian(data, 2, (unsigned char *) &pkt->id_code);
     data = get_big_endian(data, 4, (unsigned char *) &pkt->soc);
     data = get_big_endian(data, 4, (unsigned char *) &pkt->fracsec);
+	return data;
+}
+
+char *parse_c37_block(c37_packet *pkt, char *data) {
     data = get_big_endian(data, 2, (unsigned char *) &pkt->stat);
     data = get_big_endian(data, 4, (unsigned char *) &pkt->voltage_amplitude);
     data = get_big_endian(data, 4, (unsigned char *) &pkt->voltage_angle);
@@ -47,8 +71,22 @@ c37_packet *get_c37_packet(char *data) {
     data = get_big_endian(data, 4, (unsigned char *) &pkt->current_angle);
     data = get_big_endian(data, 4, (unsigned char *) &pkt->voltage_frequency);
     data = get_big_endian(data, 4, (unsigned char *) &pkt->delta_frequency);
+	return data;
+}
+
+void parse_c37_packet(c37_packet *pkt, char *data) {
+    data = parse_c37_header(pkt, data);
+    data = parse_c37_block(pkt, data);
     data = get_big_endian(data, 2, (unsigned char *) &pkt->crc);
+}
 
+c37_packet *get_c37_packet(char *data) {
+    c37_packet *pkt = malloc(sizeof(c37_packet));
+	if (pkt == 0) {
+		return 0;
+	}
+
+	parse_c37_packet(pkt, data);
 	return pkt;
 }
 
@@ -69,14 +107,29 @@ uint16_t ComputeCRC(unsigned char *msg, unsigned int msglen) {
     return crc;
 }
 
-void form_c37_packet(char *buf, c37_packet *pkt) {
-    char *ptr = buf;
+/* Checks the CRC at the end of a whole frame of the given size.
+ */
+int c37_check_crc(char *frame, size_t size) {
+	uint16_t crc;
 
+	if (size < HEADER_SIZE + CRC_SIZE)
+		return 0;
+	get_big_endian(&frame[size - CRC_SIZE], 2, (unsigned char *) &crc);
+	return crc == ComputeCRC((unsigned char *)frame, size - CRC_SIZE);
+}
+
+char *form_c37_header(char *ptr, c37_packet *pkt) {
     ptr = put_big_endian(ptr, 2, (unsigned char *) &pkt->sync);
     ptr = put_big_endian(ptr, 2, (unsigned char *) &pkt->framesize);
     ptr = put_big_endian(ptr, 2, (unsigned char *) &pkt->id_code);
     ptr = put_big_endian(ptr, 4, (unsigned char *) &pkt->soc);
     ptr = put_big_endian(ptr, 4, (unsigned char *) &pkt->fracsec);
+	return ptr;
+}
+
+/* The per-PMU part of a data frame, which a PDC repeats once per PMU.
+ */
+char *form_c37_block(char *ptr, c37_packet *pkt) {
     ptr = put_big_endian(ptr, 2, (unsigned char *) &pkt->stat);
     ptr = put_big_endian(ptr, 4, (unsigned char *) &pkt->voltage_amplitude);
     ptr = put_big_endian(ptr, 4, (unsigned char *) &pkt->voltage_angle);
@@ -84,8 +137,16 @@ void form_c37_packet(char *buf, c37_packet *pkt) {
     ptr = put_big_endian(ptr, 4, (unsigned char *) &pkt->current_angle);
     ptr = put_big_endian(ptr, 4, (unsigned char *) &pkt->voltage_frequency);
     ptr = put_big_endian(ptr, 4, (unsigned char *) &pkt->delta_frequency);
+	return ptr;
+}
+
+void form_c37_packet(char *buf, c37_packet *pkt) {
+    char *ptr = buf;
+
+    ptr = form_c37_header(ptr, pkt);
+    ptr = form_c37_block(ptr, pkt);
+    pkt->crc = ComputeCRC((unsigned char *)buf, pkt->framesize-2);
     ptr = put_big_endian(ptr, 2, (unsigned char *) &pkt->crc);
-    (void) ComputeCRC((unsigned char *)buf, pkt->framesize-2);
 }
 
 void write_c37_packet(FILE *output, c37_packet *pkt) {
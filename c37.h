@@ -1,4 +1,19 @@
+#ifndef C37_H
+#define C37_H
+
+#include <stdint.h>
+#include <stdio.h>
+
 #define FRAME_SIZE		42
+#define HEADER_SIZE		14	/* sync through fracsec */
+#define BLOCK_SIZE		26	/* stat through delta_frequency */
+#define CRC_SIZE		2
+
+/* Fractions of a second per second in fracsec, as written by pmuplayer.
+ */
+#define TIME_BASE		1000000
+
+#define SYNC_DATA		0xAA01
 
 typedef struct {
     uint16_t sync;
@@ -16,6 +31,22 @@ typedef struct {
     uint16_t crc;
 } c37_packet;
 
+char *get_big_endian(char *ptr, int size, unsigned char *data);
+char *put_big_endian(char *ptr, int size, unsigned char *data);
+uint16_t ComputeCRC(unsigned char *msg, unsigned int msglen);
+
+int c37_frame_size(char *data, size_t length);
+int c37_is_data(char *data);
+int c37_check_crc(char *frame, size_t size);
+
 c37_packet *get_c37_packet(char *data);
+char *parse_c37_header(c37_packet *pkt, char *data);
+char *parse_c37_block(c37_packet *pkt, char *data);
+void parse_c37_packet(c37_packet *pkt, char *data);
+char *form_c37_header(char *ptr, c37_packet *pkt);
+char *form_c37_block(char *ptr, c37_packet *pkt);
+void form_c37_packet(char *buf, c37_packet *pkt);
 void write_c37_packet(FILE *output, c37_packet *pkt);
 void write_c37_packet_readable(FILE *output, c37_packet *pkt);
+
+#endif
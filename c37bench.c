@@ -0,0 +1,429 @@
+#include "analytics.h"
+#include "c37.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Microbenchmarks for the C37.118 codec, the analytics stage and the log
+ * writer, run over the real frames of a capture file.  Each benchmark
+ * repeats until it has run for long enough to time, and reports
+ * nanoseconds and operations per second, plus megabytes per second where
+ * it moves bytes.  Results go out one per line, tab-separated, so that
+ * runs can be compared; given the results of an earlier run, c37bench
+ * reports the change in each, and fails if any has slowed down by more
+ * than the tolerance.
+ */
+
+#define MIN_NSEC	200000000ULL
+
+struct arguments {
+	char *name;
+	char *input;
+	char *output;
+	char *baseline;
+	int tolerance;
+};
+
+struct result {
+	char name[64];
+	unsigned long long ops;
+	double nsec;
+	double bytes;
+};
+
+struct bench {
+	char *frames;
+	size_t nframes;
+	FILE *null;
+	char *logdir;
+	struct analytics *analytics;
+	struct result *results;
+	int nresults;
+	volatile unsigned long sink;
+};
+
+static void usage(struct arguments *args)
+{
+	fprintf(stderr, "Usage: %s [args] capture-file\n", args->name);
+	fprintf(stderr, "Optional arguments:\n");
+	fprintf(stderr, "	-o output:    "
+		"results file [default = standard output]\n");
+	fprintf(stderr, "	-c baseline:  "
+		"results of an earlier run to compare against\n");
+	fprintf(stderr, "	-t percent:   "
+		"slowdown that counts as a regression [default = 10]\n");
+	exit(1);
+}
+
+static void parse_arguments(struct arguments *args, int argc, char **argv)
+{
+	int c;
+
+	args->name = argv[0];
+	args->tolerance = 10;
+	while ((c = getopt(argc, argv, "c:o:t:")) != -1)
+		switch (c) {
+		case 'c':
+			args->baseline = optarg;
+			break;
+		case 'o':
+			args->output = optarg;
+			break;
+		case 't':
+			args->tolerance = atoi(optarg);
+			if (args->tolerance <= 0)
+				usage(args);
+			break;
+		default:
+			usage(args);
+		}
+
+	if (argc - optind != 1)
+		usage(args);
+	args->input = argv[optind];
+}
+
+static unsigned long long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Keeps only the 42-byte data frames, which is all the codec handles.
+ */
+static void load_frames(struct bench *b, const char *path)
+{
+	FILE *file;
+	char frame[FRAME_SIZE];
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fread(frame, FRAME_SIZE, 1, file) == 1) {
+		if (c37_frame_size(frame, FRAME_SIZE) != FRAME_SIZE ||
+		    !c37_is_data(frame))
+			continue;
+		b->frames = realloc(b->frames, (b->nframes + 1) * FRAME_SIZE);
+		if (!b->frames) {
+			perror("Loading frames");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(&b->frames[b->nframes++ * FRAME_SIZE], frame,
+		       FRAME_SIZE);
+	}
+	fclose(file);
+
+	if (!b->nframes) {
+		fprintf(stderr, "%s: no data frames\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static struct result *add_result(struct bench *b, const char *name)
+{
+	struct result *r;
+
+	b->results = realloc(b->results, (b->nresults + 1) * sizeof(*r));
+	if (!b->results) {
+		perror("Recording results");
+		exit(EXIT_FAILURE);
+	}
+	r = &b->results[b->nresults++];
+	memset(r, 0, sizeof(*r));
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	return r;
+}
+
+typedef void (*codec_fn)(struct bench *b, char *frame, c37_packet *pkt);
+
+static void run_get(struct bench *b, char *frame, c37_packet *pkt)
+{
+	c37_packet *p = get_c37_packet(frame);
+
+	(void)pkt;
+	b->sink += p->soc;
+	free(p);
+}
+
+static void run_parse(struct bench *b, char *frame, c37_packet *pkt)
+{
+	parse_c37_packet(pkt, frame);
+	b->sink += pkt->soc;
+}
+
+static void run_form(struct bench *b, char *frame, c37_packet *pkt)
+{
+	char buf[FRAME_SIZE];
+
+	(void)frame;
+	form_c37_packet(buf, pkt);
+	b->sink += buf[FRAME_SIZE - 1];
+}
+
+static void run_write(struct bench *b, char *frame, c37_packet *pkt)
+{
+	(void)frame;
+	write_c37_packet(b->null, pkt);
+}
+
+static void run_readable(struct bench *b, char *frame, c37_packet *pkt)
+{
+	(void)frame;
+	write_c37_packet_readable(b->null, pkt);
+}
+
+static void run_crc(struct bench *b, char *frame, c37_packet *pkt)
+{
+	(void)pkt;
+	b->sink += ComputeCRC((unsigned char *)frame, FRAME_SIZE - CRC_SIZE);
+}
+
+static void run_analytics(struct bench *b, char *frame, c37_packet *pkt)
+{
+	(void)pkt;
+	analytics_frame(b->analytics, frame, FRAME_SIZE);
+}
+
+/* Runs a codec function over every frame in turn, after parsing each
+ * frame up front so that formatting benchmarks time only formatting.
+ */
+static void bench_codec(struct bench *b, const char *name, codec_fn fn,
+			size_t bytes)
+{
+	struct result *r = add_result(b, name);
+	c37_packet *pkts;
+	unsigned long long start;
+	unsigned long long elapsed;
+	size_t i;
+
+	pkts = malloc(b->nframes * sizeof(*pkts));
+	if (!pkts) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < b->nframes; i++)
+		parse_c37_packet(&pkts[i], &b->frames[i * FRAME_SIZE]);
+
+	start = now();
+	do {
+		for (i = 0; i < b->nframes; i++)
+			fn(b, &b->frames[i * FRAME_SIZE], &pkts[i]);
+		r->ops += b->nframes;
+		elapsed = now() - start;
+	} while (elapsed < MIN_NSEC);
+
+	r->nsec = elapsed;
+	r->bytes = (double)r->ops * bytes;
+	free(pkts);
+}
+
+/* Writes the frames to a log in chunks of the given size, rotating every
+ * rotate bytes if that is not 0.  Each operation is one log_write().
+ */
+static void bench_log(struct bench *b, size_t chunk, size_t rotate)
+{
+	struct result *r;
+	struct log *log;
+	char name[64];
+	char prefix[4096];
+	char *data;
+	size_t total = b->nframes * FRAME_SIZE;
+	size_t offset;
+	size_t n;
+	unsigned long long start;
+	unsigned long long elapsed;
+
+	if (rotate)
+		snprintf(name, sizeof(name), "log_write/%zu/rotate-%zu", chunk,
+			 rotate);
+	else
+		snprintf(name, sizeof(name), "log_write/%zu", chunk);
+	r = add_result(b, name);
+
+	/* Chunks may be larger than the capture, so wrap around it.
+	 */
+	data = malloc(chunk);
+	if (!data) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	for (offset = 0; offset < chunk; offset += n) {
+		n = chunk - offset < total ? chunk - offset : total;
+		memcpy(&data[offset], b->frames, n);
+	}
+
+	snprintf(prefix, sizeof(prefix), "%s/log.", b->logdir);
+	log = log_start(prefix, rotate, rotate ? 4 : 0);
+	if (!log) {
+		perror(prefix);
+		exit(EXIT_FAILURE);
+	}
+
+	start = now();
+	do {
+		for (n = 0; n < 64; n++) {
+			if (log_write(log, data, chunk) < chunk) {
+				perror(name);
+				exit(EXIT_FAILURE);
+			}
+		}
+		r->ops += 64;
+		elapsed = now() - start;
+	} while (elapsed < MIN_NSEC);
+
+	r->nsec = elapsed;
+	r->bytes = (double)r->ops * chunk;
+	log_stop(log);
+	free(data);
+}
+
+static void remove_logs(struct bench *b)
+{
+	char path[4096];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/log.", b->logdir);
+	unlink(path);
+	for (i = 0; i < 4; i++) {
+		snprintf(path, sizeof(path), "%s/log.%d", b->logdir, i);
+		unlink(path);
+	}
+	rmdir(b->logdir);
+}
+
+static void write_results(struct bench *b, FILE *output)
+{
+	struct result *r;
+	double seconds;
+	int i;
+
+	fprintf(output, "# benchmark\tops\tns/op\tops/s\tMB/s\n");
+	for (i = 0; i < b->nresults; i++) {
+		r = &b->results[i];
+		seconds = r->nsec / 1e9;
+		fprintf(output, "%s\t%llu\t%.2f\t%.0f\t%.2f\n", r->name,
+			r->ops, r->nsec / r->ops, r->ops / seconds,
+			r->bytes / seconds / 1e6);
+	}
+}
+
+/* Returns the number of benchmarks that regressed.
+ */
+static int compare_results(struct bench *b, struct arguments *args)
+{
+	FILE *file;
+	char line[256];
+	char name[64];
+	double nsop;
+	double change;
+	int regressions = 0;
+	int i;
+
+	file = fopen(args->baseline, "r");
+	if (!file) {
+		perror(args->baseline);
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#' ||
+		    sscanf(line, "%63[^\t]\t%*u\t%lf", name, &nsop) != 2)
+			continue;
+		for (i = 0; i < b->nresults; i++)
+			if (!strcmp(b->results[i].name, name))
+				break;
+		if (i == b->nresults || nsop <= 0)
+			continue;
+
+		change = (b->results[i].nsec / b->results[i].ops - nsop) /
+		    nsop * 100;
+		fprintf(stderr, "%-32s %+7.1f%%%s\n", name, change,
+			change > args->tolerance ? "  REGRESSION" : "");
+		if (change > args->tolerance)
+			regressions++;
+	}
+
+	fclose(file);
+	return regressions;
+}
+
+int main(int argc, char **argv)
+{
+	struct analytics_stats astats;
+	struct arguments args;
+	struct bench b;
+	FILE *output = stdout;
+	char logdir[] = "/tmp/c37bench.XXXXXX";
+	static const size_t chunks[] = { FRAME_SIZE, 4096, 65536 };
+	int regressions = 0;
+	unsigned int i;
+
+	memset(&args, 0, sizeof(args));
+	parse_arguments(&args, argc, argv);
+
+	memset(&b, 0, sizeof(b));
+	memset(&astats, 0, sizeof(astats));
+	load_frames(&b, args.input);
+
+	b.null = fopen("/dev/null", "w");
+	if (!b.null) {
+		perror("/dev/null");
+		exit(EXIT_FAILURE);
+	}
+	b.logdir = mkdtemp(logdir);
+	if (!b.logdir) {
+		perror(logdir);
+		exit(EXIT_FAILURE);
+	}
+
+	bench_codec(&b, "get_c37_packet", run_get, FRAME_SIZE);
+	bench_codec(&b, "parse_c37_packet", run_parse, FRAME_SIZE);
+	bench_codec(&b, "form_c37_packet", run_form, FRAME_SIZE);
+	bench_codec(&b, "write_c37_packet", run_write, FRAME_SIZE);
+	bench_codec(&b, "write_c37_packet_readable", run_readable, 0);
+	bench_codec(&b, "ComputeCRC", run_crc, FRAME_SIZE - CRC_SIZE);
+
+	b.analytics = analytics_start("window:32,vrms:0.9:1.1,fdev:0.05,"
+				      "angle:10", "bench", NULL, &astats);
+	if (!b.analytics) {
+		perror("Starting analytics");
+		exit(EXIT_FAILURE);
+	}
+	bench_codec(&b, "analytics_frame", run_analytics, FRAME_SIZE);
+	analytics_stop(b.analytics);
+
+	for (i = 0; i < sizeof(chunks) / sizeof(*chunks); i++)
+		bench_log(&b, chunks[i], 0);
+	for (i = 0; i < sizeof(chunks) / sizeof(*chunks); i++)
+		bench_log(&b, chunks[i], 1024 * 1024);
+
+	remove_logs(&b);
+	fclose(b.null);
+
+	/* The baseline may be the file about to be overwritten.
+	 */
+	if (args.baseline)
+		regressions = compare_results(&b, &args);
+
+	if (args.output) {
+		output = fopen(args.output, "w");
+		if (!output) {
+			perror(args.output);
+			exit(EXIT_FAILURE);
+		}
+	}
+	write_results(&b, output);
+	if (output != stdout)
+		fclose(output);
+
+	return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
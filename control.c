@@ -0,0 +1,281 @@
+#include "control.h"
+#include "recent.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* The control socket answers queries about the recent-window caches from a
+ * thread of its own, one connection at a time, so that a slow client holds
+ * up only other clients.  Each connection sends one line and gets back
+ * tab-separated lines until the server closes it:
+ *
+ *	list			name frames oldest newest, for each stream
+ *	get name [seconds]	time stat vamp vang iamp iang freq dfreq,
+ *				for each frame in the last seconds
+ *
+ * Times are in seconds.  Errors come back as a single line starting with
+ * "error".
+ */
+
+#define REQUEST_SIZE	512
+#define CLIENT_TIMEOUT	1
+
+struct control {
+	char *path;
+	int sock;
+	int pipe[2];
+	pthread_t thread;
+	int started;
+	struct recent **caches;
+	int count;
+	struct recent_frame *frames;
+	size_t size;
+};
+
+static void print_time(FILE *output, uint64_t time)
+{
+	fprintf(output, "%llu.%06llu", (unsigned long long)time / 1000000,
+		(unsigned long long)time % 1000000);
+}
+
+static void list_streams(struct control *ctl, FILE *output)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < ctl->count; i++) {
+		n = recent_snapshot(ctl->caches[i], ctl->frames, ctl->size, 0);
+		fprintf(output, "%s\t%zu\t", recent_name(ctl->caches[i]), n);
+		print_time(output, n ? ctl->frames[0].time : 0);
+		fprintf(output, "\t");
+		print_time(output, n ? ctl->frames[n - 1].time : 0);
+		fprintf(output, "\n");
+	}
+}
+
+static void get_frames(struct control *ctl, struct recent *r,
+		       double seconds, FILE *output)
+{
+	struct recent_frame *f;
+	size_t n;
+	size_t i;
+
+	n = recent_snapshot(r, ctl->frames, ctl->size, seconds * 1000000);
+	for (i = 0; i < n; i++) {
+		f = &ctl->frames[i];
+		print_time(output, f->time);
+		fprintf(output, "\t0x%04x\t%g\t%g\t%g\t%g\t%g\t%g\n", f->stat,
+			f->voltage_amplitude, f->voltage_angle,
+			f->current_amplitude, f->current_angle, f->frequency,
+			f->delta_frequency);
+	}
+}
+
+static void answer(struct control *ctl, char *request, FILE *output)
+{
+	char *save;
+	char *command;
+	char *name;
+	char *arg;
+	char *end;
+	double seconds = 0;
+	int i;
+
+	command = strtok_r(request, " \t\r\n", &save);
+	name = strtok_r(NULL, " \t\r\n", &save);
+	arg = strtok_r(NULL, " \t\r\n", &save);
+
+	if (command && !strcmp(command, "list") && !name) {
+		list_streams(ctl, output);
+		return;
+	}
+
+	if (!command || strcmp(command, "get") || !name ||
+	    strtok_r(NULL, " \t\r\n", &save)) {
+		fprintf(output, "error\tbad request\n");
+		return;
+	}
+	if (arg) {
+		seconds = strtod(arg, &end);
+		if (*end || seconds <= 0) {
+			fprintf(output, "error\tbad seconds\n");
+			return;
+		}
+	}
+
+	for (i = 0; i < ctl->count; i++)
+		if (!strcmp(recent_name(ctl->caches[i]), name)) {
+			get_frames(ctl, ctl->caches[i], seconds, output);
+			return;
+		}
+	fprintf(output, "error\tno such stream\n");
+}
+
+/* Reads one request line, giving up on clients that take too long.  The
+ * answer is formed in memory and sent without SIGPIPE, so a client that
+ * hangs up early costs nothing but its own answer.
+ */
+static void serve(struct control *ctl, int sock)
+{
+	struct timeval timeout = { CLIENT_TIMEOUT, 0 };
+	char request[REQUEST_SIZE];
+	FILE *output;
+	char *answer_data = NULL;
+	size_t answer_size = 0;
+	size_t length = 0;
+	size_t sent;
+	ssize_t n;
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	while (length < sizeof(request) - 1) {
+		n = recv(sock, &request[length], sizeof(request) - 1 - length,
+			 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		length += n;
+		if (memchr(request, '\n', length))
+			break;
+	}
+	request[length] = '\0';
+
+	output = open_memstream(&answer_data, &answer_size);
+	if (!output) {
+		close(sock);
+		return;
+	}
+	answer(ctl, request, output);
+	if (fclose(output)) {
+		free(answer_data);
+		close(sock);
+		return;
+	}
+
+	for (sent = 0; sent < answer_size; sent += n) {
+		n = send(sock, &answer_data[sent], answer_size - sent,
+			 MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n < 0)
+			break;
+	}
+	free(answer_data);
+	close(sock);
+}
+
+static void *run_control(void *arg)
+{
+	struct control *ctl = arg;
+	struct pollfd fds[2];
+	int sock;
+
+	fds[0].fd = ctl->sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = ctl->pipe[0];
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Control socket");
+			break;
+		}
+		if (fds[1].revents)
+			break;
+
+		sock = accept(ctl->sock, NULL, NULL);
+		if (sock >= 0)
+			serve(ctl, sock);
+	}
+
+	return NULL;
+}
+
+struct control *control_start(const char *path, struct recent **caches,
+			      int count)
+{
+	struct sockaddr_un addr;
+	struct control *ctl;
+	int err;
+	int i;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	ctl = calloc(1, sizeof(*ctl));
+	if (!ctl)
+		return NULL;
+	ctl->sock = -1;
+	ctl->pipe[0] = ctl->pipe[1] = -1;
+	ctl->caches = caches;
+	ctl->count = count;
+
+	for (i = 0; i < count; i++)
+		if (recent_size(caches[i]) > ctl->size)
+			ctl->size = recent_size(caches[i]);
+	ctl->frames = calloc(ctl->size ? ctl->size : 1, sizeof(*ctl->frames));
+	ctl->path = strdup(path);
+	if (!ctl->frames || !ctl->path)
+		goto fail;
+
+	ctl->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ctl->sock < 0 || pipe(ctl->pipe) < 0)
+		goto fail;
+	unlink(path);
+	if (bind(ctl->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(ctl->sock, 16) < 0)
+		goto fail;
+
+	err = pthread_create(&ctl->thread, NULL, run_control, ctl);
+	if (err) {
+		errno = err;
+		goto fail;
+	}
+	ctl->started = 1;
+	return ctl;
+
+fail:
+	err = errno;
+	control_stop(ctl);
+	errno = err;
+	return NULL;
+}
+
+void control_stop(struct control *ctl)
+{
+	if (ctl->started) {
+		if (write(ctl->pipe[1], "", 1) < 0)
+			perror("Stopping control socket");
+		pthread_join(ctl->thread, NULL);
+	}
+	if (ctl->sock >= 0) {
+		close(ctl->sock);
+		unlink(ctl->path);
+	}
+	if (ctl->pipe[0] >= 0) {
+		close(ctl->pipe[0]);
+		close(ctl->pipe[1]);
+	}
+	free(ctl->frames);
+	free(ctl->path);
+	free(ctl);
+}
@@ -0,0 +1,11 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+struct recent;
+struct control;
+
+struct control *control_start(const char *path, struct recent **caches,
+			      int count);
+void control_stop(struct control *ctl);
+
+#endif
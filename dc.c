@@ -1,18 +1,41 @@
+#include "analytics.h"
+#include "c37.h"
+#include "control.h"
+#include "decimate.h"
+#include "flight.h"
+#include "hedge.h"
+#include "latency.h"
 #include "log.h"
+#include "lowlat.h"
+#include "net.h"
+#include "pdc.h"
+#include "quality.h"
+#include "recent.h"
+#include "shed.h"
+#include "shmring.h"
+#include "tstamp.h"
+#include "udp.h"
+#include "worker.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#define RING_BYTES	(1 << 20)
+#define RING_MIN	4096
+
 struct arguments {
 	char *name;
 	char *logprefix;
@@ -23,12 +46,88 @@ struct arguments {
 	char *pushhost;
 	char *pushport;
 	char *id;
+	int pdcid;
+	int pdcwait;
+	int pdcrate;
+	int hedge;
+	int interval;
+	char *decimate;
+	int nsources;
+	char **sources;
+	int nsinks;
+	char **sinks;
+	char *streamfile;
+	char *udp;
+	int workers;
+	char *cpus;
+	int rebalance;
+	int tries;
+	int timeout;
+	int mux;
+	char *shed;
+	int shedbytes;
+	char *events;
+	FILE *eventlog;
+	char *ring;
+	int ringbytes;
+	char *analytics;
+	char *control;
+	int window;
+	int lowlat;
+	int rtcpu;
+	int residence;
+	int timestamps;
+	char *flight;
+};
+
+struct source {
+	char *host;
+	char *port;
+	char *id;
+	struct sockaddr_in addr;
+	int sock;
+	struct quality *quality;
+	struct quality_stats stats;
+	struct analytics *analytics;
+	struct analytics_stats analytics_stats;
+	struct recent *recent;
+	size_t length;
+	char buffer[65536];
+};
+
+struct sink {
+	char *host;
+	char *port;
+	struct sockaddr_in addr;
+	int sock;
+	struct decimator *decimator;
+};
+
+struct collector {
+	struct pdc *pdc;
+	struct hedge *hedge;
+	struct udp *udp;
+	struct log *log;
+	struct shmring *ring;
+	struct control *control;
+	struct recent **caches;
+	struct latency *residence;
+	struct source *sources;
+	int nsources;
+	struct sink *sinks;
+	int nsinks;
+	int interval;
+	int spin;
+	FILE *events;
 };
 
 static void usage(struct arguments *args)
 {
 	fprintf(stderr, "Usage: %s [args] "
 		"src-ip src-port stream-id dst-ip dst-port\n", args->name);
+	fprintf(stderr, "       %s [args] -f stream-file\n", args->name);
+	fprintf(stderr, "       %s [args] -u [address:]port dst-ip dst-port\n",
+		args->name);
 	fprintf(stderr, "Optional arguments:\n");
 	fprintf(stderr, "	-l log-file:  "
 		"prefix of log file name [default = no logging]\n");
@@ -36,15 +135,101 @@ static void usage(struct arguments *args)
 		"maximum size of a log file [default = unlimited]\n");
 	fprintf(stderr, "	-n log-count: "
 		"maximum #log files [default = unlimited]\n");
+	fprintf(stderr, "	-P pdc-id:    "
+		"merge sources into combined frames [default = off]\n");
+	fprintf(stderr, "	-a src-ip:src-port:stream-id: "
+		"additional source to merge\n");
+	fprintf(stderr, "	-H:           "
+		"sources are copies; forward the first copy of each frame\n");
+	fprintf(stderr, "	-w wait-ms:   "
+		"longest wait for late sources [default = 100]\n");
+	fprintf(stderr, "	-r rate:      "
+		"source frames per second [default = 30]\n");
+	fprintf(stderr, "	-d decimation: "
+		"nth:N, rate:R or avg:R for the sink [default = off]\n");
+	fprintf(stderr, "	-o dst-ip:dst-port[:decimation]: "
+		"additional sink\n");
+	fprintf(stderr, "	-i interval:  "
+		"seconds between statistics reports [default = at exit]\n");
+	fprintf(stderr, "	-e event-log: "
+		"log data quality problems, - for stdout [default = off]\n");
+	fprintf(stderr, "	-A analytics: "
+		"rolling statistics and alarm limits, e.g. vrms:0.9:1.1\n");
+	fprintf(stderr, "	-R ring:      "
+		"publish frames to shared memory, a prefix with -f\n");
+	fprintf(stderr, "	-C socket:    "
+		"answer queries for recent frames on a local socket\n");
+	fprintf(stderr, "	-W seconds:   "
+		"how much of each stream to keep for -C [default = 10]\n");
+	fprintf(stderr, "	-L cpu:       "
+		"low-latency mode, spinning under SCHED_FIFO on the cpu\n");
+	fprintf(stderr, "	-B:           "
+		"measure how long data stays in dc, as percentiles\n");
+	fprintf(stderr, "	-T:           "
+		"split -B times into kernel and dc with kernel timestamps\n");
+	fprintf(stderr, "	-F dump-file: "
+		"flight recorder dump on SIGUSR1 [default = dc.pid.flight]\n");
+	fprintf(stderr, "	-u [address:]port: "
+		"receive frames over UDP, joining multicast groups\n");
+	fprintf(stderr, "	-f stream-file: "
+		"collect every stream listed, one per line\n");
+	fprintf(stderr, "	-t threads:   "
+		"worker threads for a stream file [default = 1]\n");
+	fprintf(stderr, "	-c cpus:      "
+		"CPU list or NUMA node to pin workers to, e.g. 0-3 or node1\n");
+	fprintf(stderr, "	-b seconds:   "
+		"how often to rebalance busy workers [default = never]\n");
+	fprintf(stderr, "	-k tries:     "
+		"connection attempts per stream, 0 for no limit [default = 1]\n");
+	fprintf(stderr, "	-K ms:        "
+		"how long a connection attempt may take [default = 5000]\n");
+	fprintf(stderr, "	-m:           "
+		"multiplex a worker's streams onto one connection per sink\n");
+	fprintf(stderr, "	-S policy:    "
+		"drop, divert, or a decimation when a sink falls behind\n");
+	fprintf(stderr, "	-Q bytes:     "
+		"sink queue depth that starts shedding [default = 65536]\n");
+	fprintf(stderr, "	-Z bytes:     "
+		"size of each -R ring [default = 1048576]\n");
 	exit(1);
 }
 
+/* A data path that fails leaves the flight recorder's dump behind.
+ */
+static void fail_data(const char *what)
+{
+	int err = errno;
+
+	flight_record(FLIGHT_ERROR, -1, err, 0);
+	flight_dump(0);
+	errno = err;
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static void append_argument(char ***list, int *count, char *arg)
+{
+	*list = realloc(*list, (*count + 1) * sizeof(**list));
+	if (!*list) {
+		perror("Parsing arguments");
+		exit(EXIT_FAILURE);
+	}
+	(*list)[(*count)++] = arg;
+}
+
 static void parse_arguments(struct arguments *args, int argc, char **argv)
 {
 	int c;
 
 	args->name = argv[0];
-	while ((c = getopt(argc, argv, "l:n:s:")) != -1)
+	args->pdcwait = 100;
+	args->pdcrate = 30;
+	args->shedbytes = 65536;
+	args->ringbytes = RING_BYTES;
+	args->window = 10;
+	args->tries = 1;
+	args->timeout = 5000;
+	while ((c = getopt(argc, argv, "A:BC:F:HK:L:P:Q:R:S:TW:Z:a:b:c:d:e:f:i:k:l:mn:o:r:s:t:u:w:")) != -1)
 		switch (c) {
 		case 'l':
 			args->logprefix = optarg;
@@ -59,71 +244,193 @@ static void parse_arguments(struct arguments *args, int argc, char **argv)
 			if (args->logcount <= 0)
 				usage(args);
 			break;
+		case 'P':
+			args->pdcid = atoi(optarg);
+			if (args->pdcid <= 0 || args->pdcid > 0xFFFF)
+				usage(args);
+			break;
+		case 'H':
+			args->hedge = 1;
+			break;
+		case 'a':
+			append_argument(&args->sources, &args->nsources, optarg);
+			break;
+		case 'd':
+			args->decimate = optarg;
+			break;
+		case 'e':
+			args->events = optarg;
+			break;
+		case 'R':
+			args->ring = optarg;
+			break;
+		case 'A':
+			args->analytics = optarg;
+			break;
+		case 'C':
+			args->control = optarg;
+			break;
+		case 'W':
+			args->window = atoi(optarg);
+			if (args->window <= 0)
+				usage(args);
+			break;
+		case 'L':
+			if (!isdigit((unsigned char)*optarg))
+				usage(args);
+			args->lowlat = 1;
+			args->rtcpu = atoi(optarg);
+			break;
+		case 'B':
+			args->residence = 1;
+			break;
+		case 'T':
+			args->timestamps = 1;
+			break;
+		case 'F':
+			args->flight = optarg;
+			break;
+		case 'o':
+			append_argument(&args->sinks, &args->nsinks, optarg);
+			break;
+		case 'w':
+			args->pdcwait = atoi(optarg);
+			if (args->pdcwait < 0)
+				usage(args);
+			break;
+		case 'r':
+			args->pdcrate = atoi(optarg);
+			if (args->pdcrate <= 0)
+				usage(args);
+			break;
+		case 'f':
+			args->streamfile = optarg;
+			break;
+		case 'u':
+			args->udp = optarg;
+			break;
+		case 't':
+			args->workers = atoi(optarg);
+			if (args->workers <= 0)
+				usage(args);
+			break;
+		case 'c':
+			args->cpus = optarg;
+			break;
+		case 'm':
+			args->mux = 1;
+			break;
+		case 'S':
+			args->shed = optarg;
+			break;
+		case 'Q':
+			args->shedbytes = atoi(optarg);
+			if (args->shedbytes <= 0)
+				usage(args);
+			break;
+		case 'Z':
+			args->ringbytes = atoi(optarg);
+			if (args->ringbytes < RING_MIN)
+				usage(args);
+			break;
+		case 'k':
+			args->tries = atoi(optarg);
+			if (args->tries < 0)
+				usage(args);
+			break;
+		case 'K':
+			args->timeout = atoi(optarg);
+			if (args->timeout <= 0)
+				usage(args);
+			break;
+		case 'b':
+			args->rebalance = atoi(optarg);
+			if (args->rebalance <= 0)
+				usage(args);
+			break;
+		case 'i':
+			args->interval = atoi(optarg);
+			if (args->interval <= 0)
+				usage(args);
+			break;
 		default:
 			usage(args);
 		}
 
-	if (argc - optind != 5)
-		usage(args);
-
-	args->pullhost = argv[optind++];
-	args->pullport = argv[optind++];
-	args->id = argv[optind++];
-	args->pushhost = argv[optind++];
-	args->pushport = argv[optind++];
-}
-
-static int resolve_address(struct sockaddr_in *addr, const char *host,
-			   const char *port)
-{
-	struct addrinfo hints;
-	struct addrinfo *ai;
-	int err;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
-
-	err = getaddrinfo(host, port, &hints, &ai);
-	if (err)
-		return err;
-
-	memcpy(addr, ai->ai_addr, ai->ai_addrlen);
-	freeaddrinfo(ai);
-	return 0;
-}
-
-static int connect_to_peer(struct sockaddr_in *peeraddr, uint16_t bindport)
-{
-	int s;
-	int yes = 1;
-	struct sockaddr_in self;
-
-	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (s < 0)
-		return -1;
-
-	if (bindport) {
-		self.sin_family = AF_INET;
-		self.sin_addr.s_addr = htonl(INADDR_ANY);
-		self.sin_port = htons(bindport);
+	if (args->udp) {
+		if (argc - optind != 2 || args->streamfile || args->pdcid ||
+		    args->hedge || args->nsources || args->decimate ||
+		    args->workers || args->cpus || args->rebalance ||
+		    args->mux || args->shed || args->analytics ||
+		    args->control || args->lowlat || args->residence ||
+		    args->timestamps)
+			usage(args);
+		args->pushhost = argv[optind++];
+		args->pushport = argv[optind++];
+		return;
+	}
 
-		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if (args->analytics && !analytics_spec_valid(args->analytics)) {
+		fprintf(stderr, "%s: bad analytics spec\n", args->name);
+		exit(1);
+	}
 
-		if (bind(s, (struct sockaddr *)&self, sizeof(self)) < 0) {
-			close(s);
-			return -1;
+	if (args->streamfile) {
+		if (argc - optind != 0 || args->pdcid || args->hedge ||
+		    args->nsources || args->nsinks || args->lowlat ||
+		    args->residence || args->timestamps)
+			usage(args);
+		if (args->shed && args->mux) {
+			fprintf(stderr, "%s: shedding needs one connection "
+				"per stream\n", args->name);
+			exit(1);
 		}
+		if (args->shed && !shed_policy_valid(args->shed)) {
+			fprintf(stderr, "%s: bad shedding policy\n", args->name);
+			exit(1);
+		}
+		if (args->shed && !strcmp(args->shed, "divert") &&
+		    !args->logprefix) {
+			fprintf(stderr, "%s: divert needs a log file\n",
+				args->name);
+			exit(1);
+		}
+#ifdef TCPR
+		fprintf(stderr, "%s: TCPR requires plain copying to one sink\n",
+			args->name);
+		exit(1);
+#endif
+		return;
 	}
 
-	if (connect(s, (struct sockaddr *)peeraddr, sizeof(*peeraddr)) < 0) {
-		close(s);
-		return -1;
+	if (argc - optind != 5 || args->workers || args->cpus ||
+	    args->rebalance || args->mux || args->shed)
+		usage(args);
+	if (args->nsources && !args->pdcid && !args->hedge)
+		usage(args);
+	if (args->hedge && (args->pdcid || !args->nsources))
+		usage(args);
+	if (args->timestamps &&
+	    (args->pdcid || args->hedge || args->nsinks || args->decimate ||
+	     args->events || args->ring || args->analytics || args->control)) {
+		fprintf(stderr, "%s: kernel timestamps need plain copying "
+			"to one sink\n", args->name);
+		exit(1);
 	}
+#ifdef TCPR
+	if (args->pdcid || args->hedge || args->decimate || args->nsinks ||
+	    args->events || args->ring || args->analytics || args->control) {
+		fprintf(stderr, "%s: TCPR requires plain copying to one sink\n",
+			args->name);
+		exit(1);
+	}
+#endif
 
-	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
-	return s;
+	args->pullhost = argv[optind++];
+	args->pullport = argv[optind++];
+	args->id = argv[optind++];
+	args->pushhost = argv[optind++];
+	args->pushport = argv[optind++];
 }
 
 #ifdef TCPR
@@ -266,42 +573,82 @@ static int wait_for_master(struct tcpr_ip4 *state)
 
 #endif /* TCPR */
 
+/* With spin, the source socket is non-blocking and polled, and the log is
+ * written only once the data has been sent on.  With residence, the time
+ * from receiving each chunk of data to sending the last of it is recorded,
+ * and with tstamp, its parts by kernel timestamps.
+ */
 #ifdef TCPR
 static int copy_data(struct tcpr_ip4 *state, struct log *log, int pullsock,
-		     int pushsock, int tcprsock)
+		     int pushsock, int tcprsock, int spin,
+		     struct latency *residence, struct tstamp *tstamp)
 #else
-static int copy_data(struct log *log, int pullsock, int pushsock)
+static int copy_data(struct log *log, int pullsock, int pushsock, int spin,
+		     struct latency *residence, struct tstamp *tstamp)
 #endif
 {
 	char buffer[65536];
+	struct timespec received;
+	struct timespec sent;
+	uint64_t since;
 	ssize_t nr;
 	ssize_t ns;
 	size_t n;
 
 	for (;;) {
-		nr = recv(pullsock, buffer, sizeof(buffer), 0);
+		since = flight_clock();
+		if (tstamp)
+			nr = tstamp_recv(tstamp, buffer, sizeof(buffer));
+		else
+			nr = recv(pullsock, buffer, sizeof(buffer), 0);
+		if (nr < 0 && spin && errno == EAGAIN)
+			continue;
+		flight_record(FLIGHT_RECV, pullsock, nr < 0 ? -errno : nr,
+			      since);
 		if (nr < 0)
 			return -1;
 		else if (nr == 0)
 			break;
+		if (residence)
+			clock_gettime(CLOCK_MONOTONIC, &received);
 
-		if (log) {
+		if (log && !spin) {
 			if (log_write(log, buffer, nr) < (size_t)nr)
 				return -1;
 		}
 
 		for (n = 0; n < (size_t)nr; n += ns) {
-			ns = send(pushsock, &buffer[n], nr - n, 0);
+			since = flight_clock();
+			if (tstamp)
+				ns = tstamp_send(tstamp, &buffer[n], nr - n);
+			else
+				ns = send(pushsock, &buffer[n], nr - n, 0);
+			flight_record(ns >= 0 && ns < nr - (ssize_t)n ?
+				      FLIGHT_SHORT_SEND : FLIGHT_SEND, pushsock,
+				      ns < 0 ? -errno : ns, since);
 			if (ns < 0)
 				return -1;
 
 #ifdef TCPR
 			state->tcpr.hard.ack =
 			    htonl(ntohl(state->tcpr.hard.ack) + ns);
+			since = flight_clock();
 			if (send(tcprsock, state, sizeof(*state), 0) < 0)
 				return -1;
+			flight_record(FLIGHT_TCPR_UPDATE, tcprsock,
+				      ntohl(state->tcpr.hard.ack), since);
 #endif
 		}
+
+		if (residence) {
+			clock_gettime(CLOCK_MONOTONIC, &sent);
+			latency_span(residence, &received, &sent);
+		}
+
+		if (log && spin) {
+			if (log_write(log, buffer, nr) < (size_t)nr)
+				return -1;
+		}
 	}
 
 #ifdef TCPR
@@ -314,6 +661,685 @@ static int copy_data(struct log *log, int pullsock, int pushsock)
 	return 0;
 }
 
+/* Logs and publishes a frame in full, then sends each sink what its
+ * decimator lets through.
+ */
+static int deliver_frame(struct collector *c, char *frame, size_t size)
+{
+	struct sink *sink;
+	char *out;
+	size_t n;
+	int i;
+
+	if (c->log && !c->spin) {
+		if (log_write(c->log, frame, size) < size)
+			return -1;
+	}
+
+	if (c->ring && shmring_publish(c->ring, frame, size) < 0)
+		return -1;
+
+	for (i = 0; i < c->nsinks; i++) {
+		sink = &c->sinks[i];
+		out = frame;
+		n = size;
+		if (sink->decimator)
+			n = decimator_push(sink->decimator, frame, size, &out);
+		if (n && send_all(sink->sock, out, n) < 0)
+			return -1;
+	}
+
+	if (c->log && c->spin) {
+		if (log_write(c->log, frame, size) < size)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int deliver_datagram(void *arg, char *frame, size_t size)
+{
+	return deliver_frame(arg, frame, size);
+}
+
+static void report(struct collector *c, FILE *output)
+{
+	char name[64];
+	int i;
+
+	if (c->pdc)
+		pdc_report(c->pdc, output);
+	if (c->hedge)
+		hedge_report(c->hedge, output);
+	if (c->udp)
+		udp_report(c->udp, output);
+	if (c->ring)
+		shmring_report(c->ring, output);
+	if (c->residence)
+		latency_report(c->residence, "residence", output);
+
+	for (i = 0; i < c->nsources; i++) {
+		if (!c->sources[i].quality)
+			continue;
+		snprintf(name, sizeof(name), "%s:%s:%s", c->sources[i].host,
+			 c->sources[i].port, c->sources[i].id);
+		quality_report(&c->sources[i].stats, name, output);
+	}
+
+	for (i = 0; i < c->nsources; i++) {
+		if (!c->sources[i].analytics)
+			continue;
+		snprintf(name, sizeof(name), "%s:%s:%s", c->sources[i].host,
+			 c->sources[i].port, c->sources[i].id);
+		analytics_report(&c->sources[i].analytics_stats, name, output);
+	}
+
+	for (i = 0; i < c->nsinks; i++) {
+		if (!c->sinks[i].decimator)
+			continue;
+		snprintf(name, sizeof(name), "%s:%s", c->sinks[i].host,
+			 c->sinks[i].port);
+		decimator_report(c->sinks[i].decimator, name, output);
+	}
+
+	fflush(output);
+}
+
+/* Splits a colon-separated spec into at most count fields, the last of
+ * which takes the rest of the spec.  Returns the number of fields.
+ */
+static int split_spec(char *spec, char **fields, int count)
+{
+	int n;
+
+	for (n = 0; n < count && spec; n++) {
+		fields[n] = spec;
+		spec = n + 1 < count ? strchr(spec, ':') : NULL;
+		if (spec)
+			*spec++ = '\0';
+	}
+
+	return n;
+}
+
+static void open_source(struct source *source, char *spec)
+{
+	char *fields[3];
+	int err;
+
+	if (split_spec(spec, fields, 3) != 3) {
+		fprintf(stderr, "%s: expected src-ip:src-port:stream-id\n",
+			spec);
+		exit(EXIT_FAILURE);
+	}
+	source->host = fields[0];
+	source->port = fields[1];
+	source->id = fields[2];
+
+	err = resolve_address(&source->addr, source->host, source->port);
+	if (err) {
+		fprintf(stderr, "%s:%s: %s\n", source->host, source->port,
+			gai_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Connecting to data source %s:%s.\n", source->host,
+	       source->port);
+	source->sock = connect_to_peer(&source->addr, 0);
+	if (source->sock < 0) {
+		perror("Connecting to data source");
+		exit(EXIT_FAILURE);
+	}
+
+	if (send(source->sock, source->id, strlen(source->id), 0) < 0) {
+		perror("Sending session ID");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void start_decimator(struct sink *sink, char *spec)
+{
+	sink->decimator = decimator_start(spec);
+	if (!sink->decimator) {
+		fprintf(stderr, "%s: expected nth:N, rate:R or avg:R\n", spec);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void connect_sink(struct sink *sink)
+{
+	int err;
+
+	err = resolve_address(&sink->addr, sink->host, sink->port);
+	if (err) {
+		fprintf(stderr, "%s:%s: %s\n", sink->host, sink->port,
+			gai_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Connecting to data sink %s:%s.\n", sink->host, sink->port);
+	sink->sock = connect_to_peer(&sink->addr, 0);
+	if (sink->sock < 0) {
+		perror("Connecting to data sink");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void open_sink(struct sink *sink, char *spec)
+{
+	char *fields[3];
+	int count;
+
+	count = split_spec(spec, fields, 3);
+	if (count < 2) {
+		fprintf(stderr, "%s: expected dst-ip:dst-port[:decimation]\n",
+			spec);
+		exit(EXIT_FAILURE);
+	}
+	sink->host = fields[0];
+	sink->port = fields[1];
+	connect_sink(sink);
+
+	if (count == 3)
+		start_decimator(sink, fields[2]);
+}
+
+static void start_ring(struct collector *c, char *name, size_t size)
+{
+	printf("Publishing frames to ring %s.\n", name);
+	c->ring = shmring_start(name, size);
+	if (!c->ring) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void start_quality(struct collector *c)
+{
+	struct source *source;
+	char name[256];
+	int i;
+
+	for (i = 0; i < c->nsources; i++) {
+		source = &c->sources[i];
+		snprintf(name, sizeof(name), "%s:%s:%s", source->host,
+			 source->port, source->id);
+		source->quality = quality_start(name, c->events,
+						&source->stats);
+		if (!source->quality) {
+			perror("Starting quality monitor");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* Alarms go to the event log, if any.
+ */
+static void start_analytics(struct collector *c, char *spec)
+{
+	FILE *alarms = c->events ? c->events : stdout;
+	struct source *source;
+	char name[256];
+	int i;
+
+	for (i = 0; i < c->nsources; i++) {
+		source = &c->sources[i];
+		snprintf(name, sizeof(name), "%s:%s:%s", source->host,
+			 source->port, source->id);
+		source->analytics = analytics_start(spec, name, alarms,
+						    &source->analytics_stats);
+		if (!source->analytics) {
+			perror("Starting analytics");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* Each source keeps a cache of its recent frames, size frames long, for the
+ * control socket to query.
+ */
+static void start_control(struct collector *c, char *path, size_t size)
+{
+	struct source *source;
+	char name[256];
+	int i;
+
+	c->caches = calloc(c->nsources, sizeof(*c->caches));
+	if (!c->caches) {
+		perror("Starting caches");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < c->nsources; i++) {
+		source = &c->sources[i];
+		snprintf(name, sizeof(name), "%s:%s:%s", source->host,
+			 source->port, source->id);
+		source->recent = recent_start(name, size);
+		if (!source->recent) {
+			perror("Starting caches");
+			exit(EXIT_FAILURE);
+		}
+		c->caches[i] = source->recent;
+	}
+
+	printf("Answering queries on %s.\n", path);
+	c->control = control_start(path, c->caches, c->nsources);
+	if (!c->control) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Spins on the given sockets from now on, on the forwarding CPU.
+ */
+static void start_lowlat(int cpu, int *socks, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (lowlat_socket(socks[i]) < 0) {
+			perror("Setting up sockets for low latency");
+			exit(EXIT_FAILURE);
+		}
+
+	printf("Forwarding on CPU %d.\n", cpu);
+	if (lowlat_enter(cpu) < 0) {
+		perror("Entering low-latency mode");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void stop_collector(struct collector *c)
+{
+	int i;
+
+	if (c->control)
+		control_stop(c->control);
+	for (i = 0; i < c->nsinks; i++) {
+		close(c->sinks[i].sock);
+		if (c->sinks[i].decimator)
+			decimator_stop(c->sinks[i].decimator);
+	}
+	for (i = 0; i < c->nsources; i++) {
+		if (c->sources[i].quality)
+			quality_stop(c->sources[i].quality);
+		if (c->sources[i].analytics)
+			analytics_stop(c->sources[i].analytics);
+		if (c->sources[i].recent)
+			recent_stop(c->sources[i].recent);
+	}
+	if (c->pdc)
+		pdc_stop(c->pdc);
+	if (c->hedge)
+		hedge_stop(c->hedge);
+	if (c->udp)
+		udp_stop(c->udp);
+	if (c->log)
+		log_stop(c->log);
+	if (c->ring)
+		shmring_stop(c->ring);
+	if (c->residence)
+		latency_stop(c->residence);
+	free(c->caches);
+	free(c->sinks);
+	free(c->sources);
+}
+
+/* Reads what a source has sent and passes on each complete frame, keeping
+ * any partial frame for next time.  Data frames go through the PDC when
+ * merging, and all frames through the hedge when hedging.  Returns 0 at
+ * end of stream.
+ */
+static int read_frames(struct collector *c, int index,
+		       const struct timespec *now)
+{
+	struct source *source = &c->sources[index];
+	struct timespec received;
+	struct timespec done;
+	c37_packet pkt;
+	ssize_t nr;
+	size_t n;
+	int size;
+
+	nr = recv(source->sock, &source->buffer[source->length],
+		  sizeof(source->buffer) - source->length, 0);
+	if (nr < 0 && errno == EAGAIN)
+		return 1;
+	flight_record(FLIGHT_RECV, source->sock, nr < 0 ? -errno : nr, 0);
+	if (nr <= 0)
+		return nr;
+	source->length += nr;
+	if (c->residence)
+		clock_gettime(CLOCK_MONOTONIC, &received);
+
+	for (n = 0; n < source->length; n += size) {
+		size = c37_frame_size(&source->buffer[n], source->length - n);
+		if (size < 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (size == 0 || (size_t)size > source->length - n)
+			break;
+
+		if (source->quality)
+			quality_frame(source->quality, &source->buffer[n], size);
+		if (source->analytics)
+			analytics_frame(source->analytics, &source->buffer[n],
+					size);
+		if (source->recent)
+			recent_frame(source->recent, &source->buffer[n], size);
+
+		if (c->hedge && !hedge_frame(c->hedge, index,
+					     &source->buffer[n], size, now))
+			continue;
+
+		if (!c->pdc) {
+			if (deliver_frame(c, &source->buffer[n], size) < 0)
+				return -1;
+		} else if (size == FRAME_SIZE &&
+			   c37_is_data(&source->buffer[n])) {
+			parse_c37_packet(&pkt, &source->buffer[n]);
+			pdc_add(c->pdc, index, &pkt, now);
+		}
+	}
+
+	if (c->residence) {
+		clock_gettime(CLOCK_MONOTONIC, &done);
+		latency_span(c->residence, &received, &done);
+	}
+
+	source->length -= n;
+	memmove(source->buffer, &source->buffer[n], source->length);
+	return 1;
+}
+
+static int collect_frames(struct collector *c)
+{
+	struct pollfd *fds;
+	struct timespec now;
+	time_t next;
+	char *frame;
+	size_t size;
+	uint64_t since;
+	int timeout;
+	int nfds;
+	int ready;
+	int open;
+	int err;
+	int i;
+
+	nfds = c->nsources + (c->udp ? 1 : 0);
+	fds = calloc(nfds, sizeof(*fds));
+	if (!fds)
+		return -1;
+	for (i = 0; i < c->nsources; i++) {
+		fds[i].fd = c->sources[i].sock;
+		fds[i].events = POLLIN;
+	}
+	if (c->udp) {
+		fds[c->nsources].fd = udp_socket(c->udp);
+		fds[c->nsources].events = POLLIN;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next = now.tv_sec + c->interval;
+
+	for (open = c->nsources; open > 0 || c->udp;) {
+		timeout = -1;
+		if (c->pdc) {
+			while ((size = pdc_next(c->pdc, &now, &frame)) > 0)
+				if (deliver_frame(c, frame, size) < 0)
+					goto fail;
+			timeout = pdc_timeout(c->pdc, &now);
+		}
+
+		if (c->interval) {
+			if (now.tv_sec >= next) {
+				report(c, stdout);
+				next = now.tv_sec + c->interval;
+			}
+			if (timeout < 0 || timeout > c->interval * 1000)
+				timeout = c->interval * 1000;
+		}
+		if (c->spin)
+			timeout = 0;
+
+		/* Spinning, only polls that find something are recorded.
+		 */
+		since = flight_clock();
+		ready = poll(fds, nfds, timeout);
+		if (ready || !c->spin)
+			flight_record(FLIGHT_WAIT, -1,
+				      ready < 0 ? -errno : ready, since);
+		if (ready < 0 && errno != EINTR)
+			goto fail;
+
+		if (c->udp && fds[c->nsources].revents &&
+		    udp_receive(c->udp, deliver_datagram, c) < 0)
+			goto fail;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < c->nsources; i++) {
+			if (!fds[i].revents)
+				continue;
+
+			err = read_frames(c, i, &now);
+			if (err < 0)
+				goto fail;
+			if (err == 0) {
+				printf("Source %d closed.\n", i);
+				close(c->sources[i].sock);
+				fds[i].fd = -1;
+				open--;
+			}
+		}
+	}
+
+	if (c->pdc) {
+		while ((size = pdc_next(c->pdc, NULL, &frame)) > 0)
+			if (deliver_frame(c, frame, size) < 0)
+				goto fail;
+	}
+
+	/* The sources are done, so the windows being averaged are as full
+	 * as they will get.
+	 */
+	for (i = 0; i < c->nsinks; i++) {
+		if (!c->sinks[i].decimator)
+			continue;
+		size = decimator_flush(c->sinks[i].decimator, &frame);
+		if (size && send_all(c->sinks[i].sock, frame, size) < 0)
+			goto fail;
+	}
+
+	free(fds);
+	return 0;
+
+fail:
+	err = errno;
+	free(fds);
+	errno = err;
+	return -1;
+}
+
+/* Reads a stream file, in which each line names a stream the same way as
+ * the command line does: src-ip src-port stream-id dst-ip dst-port.  Blank
+ * lines and lines starting with # are ignored.
+ */
+static struct stream_spec *read_streams(const char *filename, int *count)
+{
+	struct stream_spec *specs = NULL;
+	struct stream_spec *spec;
+	char *fields[5];
+	char line[1024];
+	FILE *file;
+	int lineno = 0;
+	int n;
+
+	file = fopen(filename, "r");
+	if (!file) {
+		perror(filename);
+		exit(EXIT_FAILURE);
+	}
+
+	*count = 0;
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		for (n = 0; n < 5; n++) {
+			fields[n] = strtok(n ? NULL : line, " \t\r\n");
+			if (!fields[n] || fields[n][0] == '#')
+				break;
+		}
+		if (n == 0)
+			continue;
+		if (n < 5 || strtok(NULL, " \t\r\n")) {
+			fprintf(stderr, "%s:%d: expected src-ip src-port "
+				"stream-id dst-ip dst-port\n", filename, lineno);
+			exit(EXIT_FAILURE);
+		}
+
+		specs = realloc(specs, (*count + 1) * sizeof(*specs));
+		if (!specs) {
+			perror("Reading streams");
+			exit(EXIT_FAILURE);
+		}
+		spec = &specs[(*count)++];
+		spec->pullhost = strdup(fields[0]);
+		spec->pullport = strdup(fields[1]);
+		spec->id = strdup(fields[2]);
+		spec->pushhost = strdup(fields[3]);
+		spec->pushport = strdup(fields[4]);
+		if (!spec->pullhost || !spec->pullport || !spec->id ||
+		    !spec->pushhost || !spec->pushport) {
+			perror("Reading streams");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fclose(file);
+	return specs;
+}
+
+static void run_workers(struct arguments *args)
+{
+	struct worker_options options;
+	struct stream_spec *specs;
+	struct workers *pool;
+	struct sink check;
+	unsigned long elapsed;
+	int count;
+	int i;
+
+	/* Workers start their own decimators; make sure they can.
+	 */
+	if (args->decimate) {
+		start_decimator(&check, args->decimate);
+		decimator_stop(check.decimator);
+	}
+
+	specs = read_streams(args->streamfile, &count);
+	if (!count) {
+		fprintf(stderr, "%s: no streams\n", args->streamfile);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&options, 0, sizeof(options));
+	options.count = args->workers ? args->workers : 1;
+	options.cpus = args->cpus;
+	options.logprefix = args->logprefix;
+	options.logbytes = args->logbytes;
+	options.logcount = args->logcount;
+	options.decimate = args->decimate;
+	options.mux = args->mux;
+	options.shed = args->shed;
+	options.shedbytes = args->shedbytes;
+	options.quality = args->events != NULL;
+	options.events = args->eventlog ? args->eventlog : stdout;
+	options.ring = args->ring;
+	options.analytics = args->analytics;
+	options.ringbytes = args->ringbytes;
+	options.control = args->control;
+	options.recent = args->window * args->pdcrate;
+	options.tries = args->tries;
+	options.timeout = args->timeout;
+
+	printf("Collecting %d streams on %d workers.\n", count,
+	       options.count);
+	pool = workers_start(&options, specs, count);
+	if (!pool) {
+		perror("Starting workers");
+		exit(EXIT_FAILURE);
+	}
+
+	for (elapsed = 1; workers_running(pool); elapsed++) {
+		sleep(1);
+		if (args->rebalance && elapsed % args->rebalance == 0)
+			workers_rebalance(pool);
+		if (args->interval && elapsed % args->interval == 0)
+			workers_report(pool, stdout);
+	}
+
+	workers_report(pool, stdout);
+	workers_stop(pool);
+
+	for (i = 0; i < count; i++) {
+		free(specs[i].pullhost);
+		free(specs[i].pullport);
+		free(specs[i].id);
+		free(specs[i].pushhost);
+		free(specs[i].pushport);
+	}
+	free(specs);
+}
+
+static void run_udp(struct arguments *args)
+{
+	struct collector c;
+	int i;
+
+	memset(&c, 0, sizeof(c));
+	c.interval = args->interval;
+	c.nsinks = args->nsinks + 1;
+	c.sinks = calloc(c.nsinks, sizeof(*c.sinks));
+	if (!c.sinks) {
+		perror("Allocating sinks");
+		exit(EXIT_FAILURE);
+	}
+
+	c.udp = udp_start(args->udp, args->eventlog);
+	if (!c.udp) {
+		perror(args->udp);
+		exit(EXIT_FAILURE);
+	}
+
+	c.sinks[0].host = args->pushhost;
+	c.sinks[0].port = args->pushport;
+	connect_sink(&c.sinks[0]);
+	for (i = 1; i < c.nsinks; i++) {
+		open_sink(&c.sinks[i], args->sinks[i - 1]);
+		if (c.sinks[i].decimator) {
+			fprintf(stderr, "%s: decimation needs one stream "
+				"per sink\n", args->name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (args->logprefix) {
+		printf("Opening log.\n");
+		c.log = log_start(args->logprefix, args->logbytes,
+				  args->logcount);
+	}
+	if (args->ring)
+		start_ring(&c, args->ring, args->ringbytes);
+
+	printf("Receiving frames on UDP %s.\n", args->udp);
+	if (collect_frames(&c) < 0)
+		fail_data("Receiving frames");
+
+	report(&c, stdout);
+	stop_collector(&c);
+	free(args->sinks);
+}
+
 int main(int argc, char **argv)
 {
 	static const uint16_t selfport = 6667;
@@ -325,6 +1351,11 @@ int main(int argc, char **argv)
 	int recovering = 0;
 	struct arguments args;
 	struct log *log = NULL;
+	struct latency *residence = NULL;
+	struct tstamp *tstamp = NULL;
+	struct collector c;
+	int *socks;
+	int i;
 #ifdef TCPR
 	int tcprsock;
 	struct tcpr_ip4 state;
@@ -333,6 +1364,41 @@ int main(int argc, char **argv)
 	memset(&args, 0, sizeof(args));
 	parse_arguments(&args, argc, argv);
 
+	if (flight_start(args.flight) < 0) {
+		perror("Starting flight recorder");
+		exit(EXIT_FAILURE);
+	}
+	flight_thread("main");
+
+	if (args.events) {
+		args.eventlog = strcmp(args.events, "-") ?
+		    fopen(args.events, "a") : stdout;
+		if (!args.eventlog) {
+			perror(args.events);
+			exit(EXIT_FAILURE);
+		}
+		setvbuf(args.eventlog, NULL, _IOLBF, 0);
+	}
+
+	/* Threads started from here on stay off the forwarding CPU.
+	 */
+	if (args.lowlat && lowlat_reserve(args.rtcpu) < 0) {
+		perror("Reserving CPU for low latency");
+		exit(EXIT_FAILURE);
+	}
+
+	if (args.udp) {
+		run_udp(&args);
+		printf("Done.\n");
+		return EXIT_SUCCESS;
+	}
+
+	if (args.streamfile) {
+		run_workers(&args);
+		printf("Done.\n");
+		return EXIT_SUCCESS;
+	}
+
 	err = resolve_address(&pulladdr, args.pullhost, args.pullport);
 	if (err) {
 		fprintf(stderr, "%s:%s: %s\n", args.pullhost, args.pullport,
@@ -409,21 +1475,137 @@ int main(int argc, char **argv)
 		}
 	}
 
-	printf("Copying data from source to sink.\n");
+	if (args.pdcid || args.hedge || args.nsinks || args.decimate ||
+	    args.events || args.ring || args.analytics || args.control) {
+		memset(&c, 0, sizeof(c));
+		c.log = log;
+		c.interval = args.interval;
+		c.events = args.eventlog;
+		c.nsources = args.nsources + 1;
+		c.nsinks = args.nsinks + 1;
+		c.sources = calloc(c.nsources, sizeof(*c.sources));
+		c.sinks = calloc(c.nsinks, sizeof(*c.sinks));
+		if (!c.sources || !c.sinks) {
+			perror("Allocating streams");
+			exit(EXIT_FAILURE);
+		}
+
+		c.sources[0].host = args.pullhost;
+		c.sources[0].port = args.pullport;
+		c.sources[0].id = args.id;
+		c.sources[0].addr = pulladdr;
+		c.sources[0].sock = pullsock;
+		for (i = 1; i < c.nsources; i++)
+			open_source(&c.sources[i], args.sources[i - 1]);
+		if (args.events)
+			start_quality(&c);
+		if (args.analytics)
+			start_analytics(&c, args.analytics);
+		if (args.ring)
+			start_ring(&c, args.ring, args.ringbytes);
+		if (args.control)
+			start_control(&c, args.control,
+				      args.window * args.pdcrate);
+
+		c.sinks[0].host = args.pushhost;
+		c.sinks[0].port = args.pushport;
+		c.sinks[0].addr = pushaddr;
+		c.sinks[0].sock = pushsock;
+		if (args.decimate)
+			start_decimator(&c.sinks[0], args.decimate);
+		for (i = 1; i < c.nsinks; i++)
+			open_sink(&c.sinks[i], args.sinks[i - 1]);
+
+		if (args.pdcid) {
+			c.pdc = pdc_start(args.pdcid, c.nsources, args.pdcrate,
+					  args.pdcwait);
+			if (!c.pdc) {
+				perror("Starting PDC");
+				exit(EXIT_FAILURE);
+			}
+			printf("Merging data from %d sources.\n", c.nsources);
+		}
+
+		if (args.hedge) {
+			c.hedge = hedge_start(c.nsources);
+			if (!c.hedge) {
+				perror("Starting hedge");
+				exit(EXIT_FAILURE);
+			}
+			printf("Hedging across %d sources.\n", c.nsources);
+		}
+
+		if (args.residence) {
+			c.residence = latency_start();
+			if (!c.residence) {
+				perror("Starting residence times");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (args.lowlat) {
+			socks = calloc(c.nsources, sizeof(*socks));
+			if (!socks) {
+				perror("Allocating sockets");
+				exit(EXIT_FAILURE);
+			}
+			for (i = 0; i < c.nsources; i++)
+				socks[i] = c.sources[i].sock;
+			start_lowlat(args.rtcpu, socks, c.nsources);
+			free(socks);
+			c.spin = 1;
+		}
+
+		printf("Copying frames to %d sinks.\n", c.nsinks);
+		if (collect_frames(&c) < 0)
+			fail_data("Copying frames");
+
+		report(&c, stdout);
+		stop_collector(&c);
+		free(args.sinks);
+		free(args.sources);
+	} else {
+		if (args.residence) {
+			residence = latency_start();
+			if (!residence) {
+				perror("Starting residence times");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (args.timestamps) {
+			tstamp = tstamp_start(pullsock, pushsock);
+			if (!tstamp) {
+				perror("Enabling kernel timestamps");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (args.lowlat)
+			start_lowlat(args.rtcpu, &pullsock, 1);
+
+		printf("Copying data from source to sink.\n");
 #ifdef TCPR
-	if (copy_data(&state, log, pullsock, pushsock, tcprsock) < 0) {
+		if (copy_data(&state, log, pullsock, pushsock, tcprsock,
+			      args.lowlat, residence, tstamp) < 0)
 #else
-	if (copy_data(log, pullsock, pushsock) < 0) {
+		if (copy_data(log, pullsock, pushsock, args.lowlat,
+			      residence, tstamp) < 0)
 #endif
-		perror("Copying data");
-		exit(EXIT_FAILURE);
+			fail_data("Copying data");
+		if (residence) {
+			latency_report(residence, "residence", stdout);
+			latency_stop(residence);
+		}
+		if (tstamp) {
+			tstamp_report(tstamp, stdout);
+			tstamp_stop(tstamp);
+		}
+		close(pullsock);
+		close(pushsock);
 	}
 
 	printf("Done.\n");
 #ifdef TCPR
 	close(tcprsock);
 #endif
-	close(pullsock);
-	close(pushsock);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "flight.h"
+
+/* Global stuff gleaned from program arguments.
+ */
+struct prog_args {
+	char *name;
+	char *file;
+	char *thread;
+	long long slow;
+} prog_args;
+
+/* An event, with the thread that recorded it.
+ */
+struct entry {
+	struct flight_event event;
+	int thread;
+};
+
+static const char *const type_names[FLIGHT_TYPES] = {
+	[FLIGHT_RECV] = "recv",
+	[FLIGHT_SEND] = "send",
+	[FLIGHT_SHORT_SEND] = "short send",
+	[FLIGHT_WAIT] = "wait",
+	[FLIGHT_LOG_ROTATE] = "log rotate",
+	[FLIGHT_TCPR_UPDATE] = "tcpr update",
+	[FLIGHT_CONNECT] = "connect",
+	[FLIGHT_CLOSE] = "close",
+	[FLIGHT_ERROR] = "error",
+};
+
+static void usage(){
+	fprintf(stderr, "Usage: %s [args] dump-file\n", prog_args.name);
+	fprintf(stderr, "Optional arguments:\n");
+	fprintf(stderr, "	-s us: only events that took at least this long\n");
+	fprintf(stderr, "	-t thread: only this thread's events, e.g. main or \"worker 0\"\n");
+	exit(1);
+}
+
+static void get_args(int argc, char *argv[]){
+	prog_args.name = argv[0];
+
+	int c;
+	while ((c = getopt(argc, argv, "s:t:")) != -1) {
+		switch (c) {
+			case 's':
+				prog_args.slow = atoll(optarg);
+				if (prog_args.slow <= 0) {
+					usage();
+				}
+				break;
+			case 't':
+				prog_args.thread = optarg;
+				break;
+			case '?':
+			default:
+				usage();
+		}
+	}
+
+	/* Get the remaining args.
+	 */
+	if (argc - optind != 1) {
+		usage();
+	}
+	prog_args.file = argv[optind];
+}
+
+static void read_all(FILE *f, void *data, size_t size){
+	if (fread(data, 1, size, f) != size) {
+		fprintf(stderr, "%s: truncated dump\n", prog_args.file);
+		exit(1);
+	}
+}
+
+static int by_time(const void *a, const void *b){
+	const struct entry *x = a;
+	const struct entry *y = b;
+
+	if (x->event.time != y->event.time) {
+		return x->event.time < y->event.time ? -1 : 1;
+	}
+	return x->thread - y->thread;
+}
+
+/* Print bytes moved, or the error a call failed with.
+ */
+static void print_bytes(long long value){
+	if (value < 0) {
+		printf("%s", strerror(-value));
+	} else if (value == 0) {
+		printf("end of stream");
+	} else {
+		printf("%lld bytes", value);
+	}
+}
+
+static void print_value(int type, long long value){
+	switch (type) {
+		case FLIGHT_RECV:
+		case FLIGHT_SEND:
+		case FLIGHT_SHORT_SEND:
+			print_bytes(value);
+			break;
+		case FLIGHT_WAIT:
+			if (value < 0) {
+				printf("%s", strerror(-value));
+			} else {
+				printf("%lld ready", value);
+			}
+			break;
+		case FLIGHT_LOG_ROTATE:
+			printf("file %lld", value);
+			break;
+		case FLIGHT_TCPR_UPDATE:
+			printf("ack %lld", value);
+			break;
+		case FLIGHT_CONNECT:
+			printf("attempt %lld", value + 1);
+			break;
+		case FLIGHT_CLOSE:
+			printf("%s", value ? strerror(value) : "end of stream");
+			break;
+		case FLIGHT_ERROR:
+			printf("%s", strerror(value));
+			break;
+		default:
+			printf("%lld", value);
+	}
+}
+
+/* Print the time of day, to the nanosecond, and the time before the dump.
+ */
+static void print_time(struct flight_header *header, uint64_t time){
+	long long real = time + header->offset;
+	time_t seconds = real / 1000000000;
+	struct tm tm;
+	char buf[32];
+
+	localtime_r(&seconds, &tm);
+	strftime(buf, sizeof(buf), "%H:%M:%S", &tm);
+	printf("%s.%09lld %+14.9f", buf, real % 1000000000,
+			((double) time - header->dumped) / 1e9);
+}
+
+/* Read a flight recorder dump from dc and print every thread's events as
+ * one timeline, oldest first.
+ */
+int main(int argc, char *argv[]){
+	get_args(argc, argv);
+
+	FILE *f = fopen(prog_args.file, "r");
+	if (f == 0) {
+		perror(prog_args.file);
+		exit(1);
+	}
+
+	struct flight_header header;
+	read_all(f, &header, sizeof(header));
+	if (memcmp(header.magic, FLIGHT_MAGIC, sizeof(header.magic)) ||
+			header.version != FLIGHT_VERSION) {
+		fprintf(stderr, "%s: not a flight recorder dump\n", prog_args.file);
+		exit(1);
+	}
+
+	struct flight_thread *threads = calloc(header.threads, sizeof(*threads));
+	struct entry *entries = 0;
+	size_t nentries = 0;
+	if (header.threads && threads == 0) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (uint32_t t = 0; t < header.threads; t++) {
+		read_all(f, &threads[t], sizeof(threads[t]));
+		threads[t].name[sizeof(threads[t].name) - 1] = '\0';
+
+		uint32_t size = threads[t].size;
+		struct flight_event *events = malloc(size * sizeof(*events));
+		if (size == 0 || events == 0) {
+			fprintf(stderr, "%s: bad ring\n", prog_args.file);
+			exit(1);
+		}
+		read_all(f, events, size * sizeof(*events));
+
+		if (prog_args.thread && strcmp(prog_args.thread, threads[t].name)) {
+			free(events);
+			continue;
+		}
+
+		uint64_t first = threads[t].first;
+		if (threads[t].last - first > size) {
+			first = threads[t].last - size;
+		}
+		entries = realloc(entries, (nentries + threads[t].last - first) *
+				sizeof(*entries));
+		if (entries == 0 && threads[t].last > first) {
+			perror("realloc");
+			exit(1);
+		}
+		for (uint64_t i = first; i < threads[t].last; i++) {
+			struct flight_event *e = &events[i % size];
+			if (e->took < prog_args.slow * 1000) {
+				continue;
+			}
+			entries[nentries].event = *e;
+			entries[nentries].thread = t;
+			nentries++;
+		}
+		free(events);
+	}
+	fclose(f);
+
+	printf("dc %d, %u threads, dumped", header.pid, header.threads);
+	if (header.signal) {
+		printf(" on signal %d (%s)", header.signal, strsignal(header.signal));
+	}
+	printf(" at ");
+	print_time(&header, header.dumped);
+	printf("\n");
+
+	qsort(entries, nentries, sizeof(*entries), by_time);
+	for (size_t i = 0; i < nentries; i++) {
+		struct flight_event *e = &entries[i].event;
+
+		print_time(&header, e->time);
+		printf("  %-12s %-11s ", threads[entries[i].thread].name,
+				e->type < FLIGHT_TYPES && type_names[e->type] ?
+				type_names[e->type] : "?");
+		if (e->fd >= 0) {
+			printf("fd %d, ", e->fd);
+		}
+		print_value(e->type, e->value);
+		if (e->took) {
+			printf(", took %.3f us", e->took / 1e3);
+		}
+		printf("\n");
+	}
+
+	free(entries);
+	free(threads);
+	return 0;
+}
@@ -0,0 +1,305 @@
+#include "c37.h"
+#include "decimate.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A decimator thins out a stream of data frames for a low-rate consumer.
+ * It is driven by a spec of the form mode:value:
+ *
+ *	nth:N	keep every Nth frame
+ *	rate:R	keep the first frame in each 1/R second, aligned to the second
+ *	avg:R	average all frames in each 1/R second, aligned to the second
+ *
+ * Averaging works on both single-PMU and combined frames, block by block.
+ * Phasors are averaged as vectors so that angles near +/-pi do not cancel,
+ * and blocks flagged invalid are left out.  A window goes out once a frame
+ * from a later one arrives, so the last window of a stream waits for
+ * decimator_flush().
+ */
+
+enum {
+	DECIMATE_NTH,
+	DECIMATE_RATE,
+	DECIMATE_AVERAGE,
+};
+
+struct average {
+	double vre;
+	double vim;
+	double ire;
+	double iim;
+	double frequency;
+	double delta;
+	unsigned int valid;
+	uint16_t stat;
+};
+
+struct decimator {
+	int mode;
+	int value;
+	int started;
+	uint64_t window;
+	c37_packet header;
+	struct average *blocks;
+	int nblocks;
+	char *frame;
+	size_t framesize;
+	size_t capacity;
+
+	unsigned long long in;
+	unsigned long long out;
+};
+
+struct decimator *decimator_start(const char *spec)
+{
+	struct decimator *dec;
+	char *end;
+	long value;
+
+	dec = calloc(1, sizeof(*dec));
+	if (!dec)
+		return NULL;
+
+	if (!strncmp(spec, "nth:", 4)) {
+		dec->mode = DECIMATE_NTH;
+		spec += 4;
+	} else if (!strncmp(spec, "rate:", 5)) {
+		dec->mode = DECIMATE_RATE;
+		spec += 5;
+	} else if (!strncmp(spec, "avg:", 4)) {
+		dec->mode = DECIMATE_AVERAGE;
+		spec += 4;
+	} else {
+		free(dec);
+		return NULL;
+	}
+
+	value = strtol(spec, &end, 10);
+	if (*end || value <= 0 || value > TIME_BASE) {
+		free(dec);
+		return NULL;
+	}
+	dec->value = value;
+
+	return dec;
+}
+
+static uint64_t frame_window(struct decimator *dec, c37_packet *header)
+{
+	uint64_t frac = header->fracsec & 0xFFFFFF;
+
+	return (uint64_t)header->soc * dec->value +
+	    frac * dec->value / TIME_BASE;
+}
+
+static void accumulate(struct decimator *dec, char *frame)
+{
+	struct average *avg;
+	c37_packet block;
+	char *ptr;
+	int i;
+
+	ptr = &frame[HEADER_SIZE];
+	for (i = 0; i < dec->nblocks; i++) {
+		ptr = parse_c37_block(&block, ptr);
+		if ((block.stat & 0x8000) || isnan(block.voltage_amplitude))
+			continue;
+
+		avg = &dec->blocks[i];
+		avg->vre += block.voltage_amplitude * cos(block.voltage_angle);
+		avg->vim += block.voltage_amplitude * sin(block.voltage_angle);
+		avg->ire += block.current_amplitude * cos(block.current_angle);
+		avg->iim += block.current_amplitude * sin(block.current_angle);
+		avg->frequency += block.voltage_frequency;
+		avg->delta += block.delta_frequency;
+		avg->stat |= block.stat;
+		avg->valid++;
+	}
+}
+
+static size_t form_average(struct decimator *dec)
+{
+	struct average *avg;
+	c37_packet header;
+	c37_packet block;
+	char *ptr;
+	int i;
+
+	header = dec->header;
+	header.soc = dec->window / dec->value;
+	header.fracsec = (header.fracsec & 0xFF000000) |
+	    (dec->window % dec->value) * TIME_BASE / dec->value;
+
+	ptr = form_c37_header(dec->frame, &header);
+	for (i = 0; i < dec->nblocks; i++) {
+		avg = &dec->blocks[i];
+		memset(&block, 0, sizeof(block));
+		if (avg->valid) {
+			block.stat = avg->stat;
+			block.voltage_amplitude = hypot(avg->vre, avg->vim) /
+			    avg->valid;
+			block.voltage_angle = atan2(avg->vim, avg->vre);
+			block.current_amplitude = hypot(avg->ire, avg->iim) /
+			    avg->valid;
+			block.current_angle = atan2(avg->iim, avg->ire);
+			block.voltage_frequency = avg->frequency / avg->valid;
+			block.delta_frequency = avg->delta / avg->valid;
+		} else {
+			block.stat = 0x8000;
+			block.voltage_amplitude = NAN;
+			block.voltage_angle = NAN;
+			block.current_amplitude = NAN;
+			block.current_angle = NAN;
+			block.voltage_frequency = NAN;
+			block.delta_frequency = NAN;
+		}
+		ptr = form_c37_block(ptr, &block);
+	}
+
+	header.crc = ComputeCRC((unsigned char *)dec->frame,
+				dec->framesize - CRC_SIZE);
+	put_big_endian(ptr, 2, (unsigned char *)&header.crc);
+	return dec->framesize;
+}
+
+/* Makes room for averaging frames of the given size, before any averaged
+ * frame is formed, so that the frame handed out is never moved.
+ */
+static int grow(struct decimator *dec, size_t size)
+{
+	int nblocks = (size - HEADER_SIZE - CRC_SIZE) / BLOCK_SIZE;
+	void *p;
+
+	if (size <= dec->capacity)
+		return 0;
+
+	p = realloc(dec->frame, size);
+	if (!p)
+		return -1;
+	dec->frame = p;
+
+	p = realloc(dec->blocks, nblocks * sizeof(*dec->blocks));
+	if (!p)
+		return -1;
+	dec->blocks = p;
+
+	dec->capacity = size;
+	return 0;
+}
+
+static size_t push_average(struct decimator *dec, char *frame, size_t size,
+			   c37_packet *header, char **out)
+{
+	uint64_t window = frame_window(dec, header);
+	size_t n = 0;
+
+	/* Frames that are not made of whole PMU blocks pass through.
+	 */
+	if (size < HEADER_SIZE + BLOCK_SIZE + CRC_SIZE ||
+	    (size - HEADER_SIZE - CRC_SIZE) % BLOCK_SIZE) {
+		*out = frame;
+		return size;
+	}
+
+	if (dec->started && window == dec->window && size == dec->framesize) {
+		accumulate(dec, frame);
+		return 0;
+	}
+
+	if (grow(dec, size) < 0)
+		return 0;
+
+	if (dec->started) {
+		n = form_average(dec);
+		*out = dec->frame;
+	}
+
+	dec->header = *header;
+	dec->nblocks = (size - HEADER_SIZE - CRC_SIZE) / BLOCK_SIZE;
+	dec->framesize = size;
+	dec->window = window;
+	dec->started = 1;
+	memset(dec->blocks, 0, dec->nblocks * sizeof(*dec->blocks));
+	accumulate(dec, frame);
+
+	return n;
+}
+
+/* Returns the size of the frame to forward in response to this one, which
+ * may be the frame itself or one built by the decimator, or 0 if nothing
+ * should be forwarded yet.
+ */
+size_t decimator_push(struct decimator *dec, char *frame, size_t size,
+		      char **out)
+{
+	c37_packet header;
+	uint64_t window;
+	size_t n = 0;
+
+	if (!c37_is_data(frame)) {
+		*out = frame;
+		return size;
+	}
+
+	dec->in++;
+
+	switch (dec->mode) {
+	case DECIMATE_NTH:
+		if ((dec->in - 1) % dec->value == 0) {
+			*out = frame;
+			n = size;
+		}
+		break;
+
+	case DECIMATE_RATE:
+		parse_c37_header(&header, frame);
+		window = frame_window(dec, &header);
+		if (!dec->started || window != dec->window) {
+			dec->window = window;
+			dec->started = 1;
+			*out = frame;
+			n = size;
+		}
+		break;
+
+	case DECIMATE_AVERAGE:
+		parse_c37_header(&header, frame);
+		n = push_average(dec, frame, size, &header, out);
+		break;
+	}
+
+	if (n)
+		dec->out++;
+	return n;
+}
+
+/* Returns the size of the frame averaged over the window still open at the
+ * end of the stream, or 0 if there is none.
+ */
+size_t decimator_flush(struct decimator *dec, char **out)
+{
+	if (dec->mode != DECIMATE_AVERAGE || !dec->started)
+		return 0;
+
+	dec->started = 0;
+	dec->out++;
+	*out = dec->frame;
+	return form_average(dec);
+}
+
+void decimator_report(struct decimator *dec, const char *name, FILE *output)
+{
+	fprintf(output, "decimate %s: %llu frames in, %llu out\n", name,
+		dec->in, dec->out);
+}
+
+void decimator_stop(struct decimator *dec)
+{
+	free(dec->blocks);
+	free(dec->frame);
+	free(dec);
+}
@@ -0,0 +1,15 @@
+#ifndef DECIMATE_H
+#define DECIMATE_H
+
+#include <stdio.h>
+
+struct decimator;
+
+struct decimator *decimator_start(const char *spec);
+size_t decimator_push(struct decimator *dec, char *frame, size_t size,
+		      char **out);
+size_t decimator_flush(struct decimator *dec, char **out);
+void decimator_report(struct decimator *dec, const char *name, FILE *output);
+void decimator_stop(struct decimator *dec);
+
+#endif
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+
+#include "flight.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* The flight recorder keeps the last events of every thread that records
+ * any, so that what dc was doing just before a stall or a failure can be
+ * read back afterwards.  Each thread writes a ring of its own, with no
+ * locks and no atomic read-modify-writes: an event costs two clock reads
+ * and a few stores.  Rings are never freed, so a thread's last events
+ * outlive it.
+ *
+ * The rings are dumped from a signal handler, using only calls that are
+ * safe there, while other threads may still be recording.  The dump notes
+ * each ring's head before and after copying it, and leaves out the events
+ * that may have been overwritten in between, along with the one that may
+ * have been half written when the dump began.
+ */
+
+#define RING_EVENTS	65536
+#define MAX_TOOK	0xffffffffULL
+
+struct ring {
+	struct ring *next;
+	struct flight_thread thread;
+	uint64_t head;
+	struct flight_event events[RING_EVENTS];
+};
+
+static __thread struct ring *mine;
+static struct ring *rings;
+
+/* Names are made up front, as the dump cannot format them.
+ */
+static char dumppath[4096];
+static char temppath[4096 + 4];
+
+static const int fatal[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+/* Names the calling thread's events, starting its ring if need be.
+ */
+void flight_thread(const char *name)
+{
+	struct ring *r = mine;
+
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			return;
+		r->thread.tid = syscall(SYS_gettid);
+		r->thread.size = RING_EVENTS;
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0,
+						    __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+		mine = r;
+	}
+	snprintf(r->thread.name, sizeof(r->thread.name), "%s", name);
+}
+
+/* Records an event.  With since, from flight_clock(), the event also
+ * notes how long it took, such as how long a call blocked.
+ */
+void flight_record(int type, int fd, int64_t value, uint64_t since)
+{
+	struct flight_event *e;
+	struct ring *r = mine;
+	uint64_t now = flight_clock();
+	uint64_t took = since ? now - since : 0;
+
+	if (!r) {
+		flight_thread("thread");
+		r = mine;
+		if (!r)
+			return;
+	}
+
+	e = &r->events[r->head % RING_EVENTS];
+	e->time = now;
+	e->value = value;
+	e->fd = fd;
+	e->took = took > MAX_TOOK ? MAX_TOOK : took;
+	e->type = type;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (size) {
+		n = write(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+static int dump_ring(int fd, struct ring *r)
+{
+	struct flight_thread thread = r->thread;
+	off_t at;
+	uint64_t after;
+
+	at = lseek(fd, 0, SEEK_CUR);
+	thread.last = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (at < 0 || write_all(fd, &thread, sizeof(thread)) < 0 ||
+	    write_all(fd, r->events, sizeof(r->events)) < 0)
+		return -1;
+
+	after = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	thread.first = after + 1 > RING_EVENTS ? after + 1 - RING_EVENTS : 0;
+	if (thread.first > thread.last)
+		thread.first = thread.last;
+
+	if (lseek(fd, at, SEEK_SET) < 0 ||
+	    write_all(fd, &thread, sizeof(thread)) < 0 ||
+	    lseek(fd, 0, SEEK_END) < 0)
+		return -1;
+	return 0;
+}
+
+/* Writes every thread's ring to the dump file, replacing it whole.  Safe
+ * to call from a signal handler; signal is the one being handled, or 0.
+ */
+int flight_dump(int signal)
+{
+	struct flight_header header;
+	struct timespec real;
+	struct ring *first;
+	struct ring *r;
+	uint32_t i;
+	int fd;
+
+	if (!dumppath[0]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FLIGHT_MAGIC, sizeof(header.magic));
+	header.version = FLIGHT_VERSION;
+	first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (r = first; r; r = r->next)
+		header.threads++;
+	clock_gettime(CLOCK_REALTIME, &real);
+	header.dumped = flight_clock();
+	header.offset = real.tv_sec * 1000000000LL + real.tv_nsec -
+	    (int64_t)header.dumped;
+	header.pid = getpid();
+	header.signal = signal;
+
+	fd = open(temppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+	if (write_all(fd, &header, sizeof(header)) < 0)
+		goto fail;
+	for (r = first, i = 0; i < header.threads; r = r->next, i++)
+		if (dump_ring(fd, r) < 0)
+			goto fail;
+	if (close(fd) < 0)
+		return -1;
+	return rename(temppath, dumppath);
+
+fail:
+	close(fd);
+	return -1;
+}
+
+static void dump_on_signal(int signal)
+{
+	int err = errno;
+
+	flight_dump(signal);
+	errno = err;
+}
+
+/* The handler is reset before it runs, so the signal, raised again on the
+ * way out, takes its default course.
+ */
+static void dump_and_die(int signal)
+{
+	flight_dump(signal);
+	raise(signal);
+}
+
+/* Sets the dump file, by default dc.pid.flight, and dumps to it on
+ * SIGUSR1 and on fatal signals.
+ */
+int flight_start(const char *path)
+{
+	struct sigaction action;
+	size_t i;
+
+	if (path)
+		snprintf(dumppath, sizeof(dumppath), "%s", path);
+	else
+		snprintf(dumppath, sizeof(dumppath), "dc.%d.flight",
+			 (int)getpid());
+	snprintf(temppath, sizeof(temppath), "%s.tmp", dumppath);
+
+	memset(&action, 0, sizeof(action));
+	sigemptyset(&action.sa_mask);
+	action.sa_handler = dump_on_signal;
+	action.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &action, NULL) < 0)
+		return -1;
+
+	action.sa_handler = dump_and_die;
+	action.sa_flags = SA_RESETHAND;
+	for (i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++)
+		if (sigaction(fatal[i], &action, NULL) < 0)
+			return -1;
+	return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Events, each with the descriptor it concerns and a value.
+ */
+enum {
+	FLIGHT_RECV = 1,	/* bytes received, or -errno */
+	FLIGHT_SEND,		/* bytes sent, or -errno */
+	FLIGHT_SHORT_SEND,	/* bytes sent, short of those asked for */
+	FLIGHT_WAIT,		/* descriptors ready after a poll */
+	FLIGHT_LOG_ROTATE,	/* number of the new log file */
+	FLIGHT_TCPR_UPDATE,	/* acknowledgment sent to TCPR */
+	FLIGHT_CONNECT,		/* connection attempts so far */
+	FLIGHT_CLOSE,		/* errno, or 0 at end of stream */
+	FLIGHT_ERROR,		/* errno of a fatal error */
+	FLIGHT_TYPES,
+};
+
+/* The dump is a header, then each thread's ring as a flight_thread and
+ * its events.  Events from first up to last are intact; times are on the
+ * monotonic clock, and adding the header's offset gives real time.
+ */
+#define FLIGHT_MAGIC	"DCFLIGHT"
+#define FLIGHT_VERSION	1
+
+struct flight_event {
+	uint64_t time;
+	int64_t value;
+	int32_t fd;
+	uint32_t took;
+	uint16_t type;
+	uint16_t spare[3];
+};
+
+struct flight_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t threads;
+	int64_t offset;
+	uint64_t dumped;
+	int32_t pid;
+	int32_t signal;
+};
+
+struct flight_thread {
+	char name[32];
+	int32_t tid;
+	uint32_t size;
+	uint64_t first;
+	uint64_t last;
+};
+
+/* Nanoseconds on the monotonic clock, for the since argument.
+ */
+static inline uint64_t flight_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int flight_start(const char *path);
+void flight_thread(const char *name);
+void flight_record(int type, int fd, int64_t value, uint64_t since);
+int flight_dump(int signal);
+
+#endif
@@ -0,0 +1,182 @@
+#include "c37.h"
+#include "hedge.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A hedge merges redundant copies of one stream, arriving over different
+ * paths, by passing on whichever copy of each frame arrives first.  It
+ * remembers the last few frames passed on, by timestamp and frame type,
+ * along with when and over which path each arrived, so that later copies
+ * can be dropped and their lag behind the first measured.  A frame older
+ * than any it still remembers is dropped as stale, since it has most
+ * likely been passed on already.
+ */
+
+#define WINDOW	64
+
+struct hedge_entry {
+	uint64_t time;
+	uint16_t sync;
+	int index;
+	struct timespec arrival;
+};
+
+struct hedge_path {
+	unsigned long long frames;
+	unsigned long long first;
+	unsigned long long late;
+	unsigned long long lag;
+	unsigned long long maxlag;
+};
+
+struct hedge {
+	int count;
+	struct hedge_path *paths;
+	struct hedge_entry entries[WINDOW];
+	int used;
+	int next;
+	uint64_t horizon;
+
+	unsigned long long frames;
+	unsigned long long forwarded;
+	unsigned long long duplicate;
+	unsigned long long stale;
+};
+
+struct hedge *hedge_start(int count)
+{
+	struct hedge *h;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+
+	h->count = count;
+	h->paths = calloc(count, sizeof(*h->paths));
+	if (!h->paths) {
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+static unsigned long long elapsed(const struct timespec *from,
+				  const struct timespec *to)
+{
+	long long ns;
+
+	ns = (long long)(to->tv_sec - from->tv_sec) * 1000000000LL +
+	    (to->tv_nsec - from->tv_nsec);
+	return ns > 0 ? ns : 0;
+}
+
+/* Looks for a frame already passed on, newest first.
+ */
+static struct hedge_entry *find(struct hedge *h, uint64_t time, uint16_t sync)
+{
+	struct hedge_entry *e;
+	int i;
+
+	for (i = 1; i <= h->used; i++) {
+		e = &h->entries[(h->next - i + WINDOW) % WINDOW];
+		if (e->time == time && e->sync == sync)
+			return e;
+	}
+	return NULL;
+}
+
+static void remember(struct hedge *h, uint64_t time, uint16_t sync, int index,
+		     const struct timespec *now)
+{
+	struct hedge_entry *e = &h->entries[h->next];
+
+	if (h->used == WINDOW) {
+		if (e->time > h->horizon)
+			h->horizon = e->time;
+	} else {
+		h->used++;
+	}
+
+	e->time = time;
+	e->sync = sync;
+	e->index = index;
+	e->arrival = *now;
+	h->next = (h->next + 1) % WINDOW;
+}
+
+/* Returns 1 if the frame, from source index, should be passed on, or 0 if
+ * a copy of it already has been.
+ */
+int hedge_frame(struct hedge *h, int index, char *frame, size_t size,
+		const struct timespec *now)
+{
+	struct hedge_path *path = &h->paths[index];
+	struct hedge_entry *e;
+	c37_packet header;
+	unsigned long long lag;
+	uint64_t time;
+
+	h->frames++;
+	path->frames++;
+
+	/* Too short to tell apart; pass it on.
+	 */
+	if (size < HEADER_SIZE) {
+		h->forwarded++;
+		return 1;
+	}
+
+	parse_c37_header(&header, frame);
+	time = (uint64_t)header.soc * TIME_BASE + (header.fracsec & 0xFFFFFF);
+
+	e = find(h, time, header.sync);
+	if (e) {
+		h->duplicate++;
+		if (e->index == index)
+			return 0;
+		lag = elapsed(&e->arrival, now);
+		path->late++;
+		path->lag += lag;
+		if (lag > path->maxlag)
+			path->maxlag = lag;
+		return 0;
+	}
+
+	if (h->horizon && time <= h->horizon) {
+		h->stale++;
+		return 0;
+	}
+
+	remember(h, time, header.sync, index, now);
+	h->forwarded++;
+	path->first++;
+	return 1;
+}
+
+void hedge_report(struct hedge *h, FILE *output)
+{
+	struct hedge_path *path;
+	int i;
+
+	fprintf(output, "hedge: %llu frames in, %llu forwarded, "
+		"%llu duplicate, %llu stale\n", h->frames, h->forwarded,
+		h->duplicate, h->stale);
+
+	for (i = 0; i < h->count; i++) {
+		path = &h->paths[i];
+		fprintf(output, "hedge: source %d: %llu frames, %llu first "
+			"(%.1f%%), %llu late by %.3f ms mean, "
+			"%.3f ms max\n", i, path->frames, path->first,
+			h->forwarded ? 100.0 * path->first / h->forwarded : 0,
+			path->late, path->late ?
+			path->lag / 1e6 / path->late : 0, path->maxlag / 1e6);
+	}
+}
+
+void hedge_stop(struct hedge *h)
+{
+	free(h->paths);
+	free(h);
+}
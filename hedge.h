@@ -0,0 +1,16 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+struct hedge;
+
+struct hedge *hedge_start(int count);
+int hedge_frame(struct hedge *h, int index, char *frame, size_t size,
+		const struct timespec *now);
+void hedge_report(struct hedge *h, FILE *output);
+void hedge_stop(struct hedge *h);
+
+#endif
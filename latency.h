@@ -0,0 +1,16 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <time.h>
+
+struct latency;
+
+struct latency *latency_start(void);
+void latency_add(struct latency *l, long long ns);
+void latency_span(struct latency *l, const struct timespec *from,
+		  const struct timespec *to);
+void latency_report(struct latency *l, const char *name, FILE *output);
+void latency_stop(struct latency *l);
+
+#endif
@@ -1,3 +1,5 @@
+#include "flight.h"
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -17,6 +19,7 @@ struct log {
 
 static int log_next(struct log *log)
 {
+	uint64_t since = flight_clock();
 	char *filename;
 	int olderr;
 
@@ -67,6 +70,7 @@ static int log_next(struct log *log)
 	}
 
 	free(filename);
+	flight_record(FLIGHT_LOG_ROTATE, log->fd, log->count, since);
 	log->count++;
 	log->bytes = 0;
 	return 0;
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+
+#include "lowlat.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* In low-latency mode, the forwarding thread has a CPU to itself, ideally
+ * one kept from the scheduler with isolcpus, and runs there under
+ * SCHED_FIFO, spinning on non-blocking sockets instead of sleeping, so that
+ * no wakeup stands between a frame's arrival and its forwarding.  All of
+ * its memory is locked and faulted in up front, and the allocator is kept
+ * from handing memory back, so the data path takes no page faults.  Every
+ * other thread is kept off the CPU.
+ */
+
+#define LOWLAT_PRIORITY	50
+#define PREFAULT_STACK	(512 * 1024)
+#define BUSY_POLL_USEC	50
+
+/* Keeps this thread, and every thread it starts from now on, off the
+ * forwarding CPU.  Call it before starting any threads.
+ */
+int lowlat_reserve(int cpu)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0)
+		return -1;
+	if (!CPU_ISSET(cpu, &set)) {
+		errno = EINVAL;
+		return -1;
+	}
+	CPU_CLR(cpu, &set);
+	if (CPU_COUNT(&set) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+static int cpu_isolated(int cpu)
+{
+	char list[4096];
+	char *p;
+	char *end;
+	long first;
+	long last;
+	FILE *file;
+
+	file = fopen("/sys/devices/system/cpu/isolated", "r");
+	if (!file)
+		return 0;
+	if (!fgets(list, sizeof(list), file))
+		list[0] = '\0';
+	fclose(file);
+
+	for (p = list; *p && *p != '\n'; p = end) {
+		if (*p == ',')
+			p++;
+		first = strtol(p, &end, 10);
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (end == p)
+			break;
+		if (cpu >= first && cpu <= last)
+			return 1;
+	}
+	return 0;
+}
+
+static void prefault_stack(void)
+{
+	volatile char stack[PREFAULT_STACK];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+/* Moves the calling thread onto the forwarding CPU for good.
+ */
+int lowlat_enter(int cpu)
+{
+	struct sched_param param;
+	cpu_set_t set;
+
+	if (!cpu_isolated(cpu))
+		fprintf(stderr, "Warning: CPU %d is not isolated.\n", cpu);
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		return -1;
+
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		return -1;
+	prefault_stack();
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = LOWLAT_PRIORITY;
+	return sched_setscheduler(0, SCHED_FIFO, &param);
+}
+
+/* Makes a socket to be read by spinning.  The kernel's own busy polling
+ * of the device queue is a bonus where the kernel and driver support it.
+ */
+int lowlat_socket(int sock)
+{
+	int usec = BUSY_POLL_USEC;
+	int flags;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec,
+		       sizeof(usec)) < 0)
+		perror("Warning: SO_BUSY_POLL");
+
+	flags = fcntl(sock, F_GETFL);
+	if (flags < 0)
+		return -1;
+	return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
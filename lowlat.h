@@ -0,0 +1,8 @@
+#ifndef LOWLAT_H
+#define LOWLAT_H
+
+int lowlat_reserve(int cpu);
+int lowlat_enter(int cpu);
+int lowlat_socket(int sock);
+
+#endif
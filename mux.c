@@ -0,0 +1,98 @@
+#include "mux.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+static int send_chunk(int sock, uint32_t stream, uint16_t type, char *data,
+		      uint16_t size)
+{
+	char header[MUX_HEADER_SIZE];
+	struct iovec iov[2];
+	struct msghdr msg;
+	uint32_t n32;
+	uint16_t n16;
+	ssize_t ns;
+
+	n32 = htonl(stream);
+	memcpy(&header[0], &n32, 4);
+	n16 = htons(type);
+	memcpy(&header[4], &n16, 2);
+	n16 = htons(size);
+	memcpy(&header[6], &n16, 2);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = data;
+	iov[1].iov_len = size;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = size ? 2 : 1;
+
+	/* Header and payload go out in one call where the socket allows.
+	 */
+	while (msg.msg_iovlen > 0) {
+		ns = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (ns < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (msg.msg_iovlen > 0 && (size_t)ns >= msg.msg_iov->iov_len) {
+			ns -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + ns;
+			msg.msg_iov->iov_len -= ns;
+		}
+	}
+
+	return 0;
+}
+
+/* Sends data for a stream, split into as many chunks as it takes.
+ */
+int mux_send(int sock, uint32_t stream, uint16_t type, char *data,
+	     size_t size)
+{
+	size_t n;
+
+	do {
+		n = size > MUX_MAX_PAYLOAD ? MUX_MAX_PAYLOAD : size;
+		if (send_chunk(sock, stream, type, data, n) < 0)
+			return -1;
+		data += n;
+		size -= n;
+	} while (size > 0);
+
+	return 0;
+}
+
+/* Returns the size of the chunk at the start of data, or 0 if more data
+ * is needed.
+ */
+int mux_parse(char *data, size_t length, struct mux_chunk *chunk)
+{
+	uint32_t n32;
+	uint16_t n16;
+
+	if (length < MUX_HEADER_SIZE)
+		return 0;
+
+	memcpy(&n32, &data[0], 4);
+	chunk->stream = ntohl(n32);
+	memcpy(&n16, &data[4], 2);
+	chunk->type = ntohs(n16);
+	memcpy(&n16, &data[6], 2);
+	chunk->length = ntohs(n16);
+	chunk->payload = &data[MUX_HEADER_SIZE];
+
+	if (length < (size_t)MUX_HEADER_SIZE + chunk->length)
+		return 0;
+	return MUX_HEADER_SIZE + chunk->length;
+}
@@ -0,0 +1,33 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A multiplexed connection carries many streams as a sequence of chunks,
+ * each made of a header and a payload.  The header holds, big-endian, the
+ * stream number, the chunk type, and the payload length.  A stream's data
+ * is bracketed by an open chunk naming it and a close chunk.
+ */
+
+#define MUX_HEADER_SIZE		8
+#define MUX_MAX_PAYLOAD		0xFFFF
+
+enum {
+	MUX_OPEN = 1,	/* payload is src-ip:src-port:stream-id */
+	MUX_DATA = 2,	/* payload is stream data */
+	MUX_CLOSE = 3,	/* no payload */
+};
+
+struct mux_chunk {
+	uint32_t stream;
+	uint16_t type;
+	uint16_t length;
+	char *payload;
+};
+
+int mux_send(int sock, uint32_t stream, uint16_t type, char *data,
+	     size_t size);
+int mux_parse(char *data, size_t length, struct mux_chunk *chunk);
+
+#endif
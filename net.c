@@ -0,0 +1,227 @@
+#include "flight.h"
+#include "net.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+int resolve_address(struct sockaddr_in *addr, const char *host,
+		    const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *ai;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	err = getaddrinfo(host, port, &hints, &ai);
+	if (err)
+		return err;
+
+	memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+	freeaddrinfo(ai);
+	return 0;
+}
+
+int connect_to_peer(struct sockaddr_in *peeraddr, uint16_t bindport)
+{
+	int s;
+	int yes = 1;
+	struct sockaddr_in self;
+
+	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s < 0)
+		return -1;
+
+	if (bindport) {
+		self.sin_family = AF_INET;
+		self.sin_addr.s_addr = htonl(INADDR_ANY);
+		self.sin_port = htons(bindport);
+
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+		if (bind(s, (struct sockaddr *)&self, sizeof(self)) < 0) {
+			close(s);
+			return -1;
+		}
+	}
+
+	if (connect(s, (struct sockaddr *)peeraddr, sizeof(*peeraddr)) < 0) {
+		close(s);
+		return -1;
+	}
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	return s;
+}
+
+/* Starts connecting without waiting for the connection, which is ready
+ * once the socket is writable.  With fastopen, the connection goes out
+ * with the first data sent, in the SYN if the peer has given us a TCP Fast
+ * Open cookie before.
+ */
+int connect_nonblocking(struct sockaddr_in *peeraddr, int fastopen)
+{
+	int s;
+	int yes = 1;
+
+	s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (s < 0)
+		return -1;
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+#ifdef TCP_FASTOPEN_CONNECT
+	if (fastopen)
+		setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes,
+			   sizeof(yes));
+#else
+	(void)fastopen;
+#endif
+
+	if (connect(s, (struct sockaddr *)peeraddr, sizeof(*peeraddr)) < 0 &&
+	    errno != EINPROGRESS) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/* Returns 1 once a connection started by connect_nonblocking() is up, 0 if
+ * it is still under way, or -1 if it failed, and makes the socket blocking
+ * again once it is up.
+ */
+int connect_finished(int sock)
+{
+	struct pollfd fd;
+	socklen_t length = sizeof(int);
+	int err;
+
+	fd.fd = sock;
+	fd.events = POLLOUT;
+	if (poll(&fd, 1, 0) < 0)
+		return -1;
+	if (!fd.revents)
+		return 0;
+
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &length) < 0)
+		return -1;
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK) < 0)
+		return -1;
+	return 1;
+}
+
+int send_all(int sock, char *data, size_t size)
+{
+	uint64_t since;
+	ssize_t ns;
+	size_t n;
+
+	for (n = 0; n < size; n += ns) {
+		since = flight_clock();
+		ns = send(sock, &data[n], size - n, MSG_NOSIGNAL);
+		flight_record((size_t)ns < size - n ? FLIGHT_SHORT_SEND :
+			      FLIGHT_SEND, sock, ns < 0 ? -errno : ns, since);
+		if (ns < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Remembers every lookup, failed or not, so that many streams from one
+ * host cost one lookup.
+ */
+
+#define RESOLVER_BUCKETS	256
+
+struct resolved {
+	struct resolved *next;
+	char *host;
+	char *port;
+	struct sockaddr_in addr;
+	int err;
+};
+
+struct resolver {
+	struct resolved *buckets[RESOLVER_BUCKETS];
+};
+
+struct resolver *resolver_start(void)
+{
+	return calloc(1, sizeof(struct resolver));
+}
+
+static unsigned int hash_name(const char *host, const char *port)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *host; host++)
+		h = (h ^ (unsigned char)*host) * 16777619u;
+	h = (h ^ ':') * 16777619u;
+	for (; *port; port++)
+		h = (h ^ (unsigned char)*port) * 16777619u;
+	return h;
+}
+
+int resolver_lookup(struct resolver *r, struct sockaddr_in *addr,
+		    const char *host, const char *port)
+{
+	struct resolved **bucket;
+	struct resolved *entry;
+
+	bucket = &r->buckets[hash_name(host, port) % RESOLVER_BUCKETS];
+	for (entry = *bucket; entry; entry = entry->next)
+		if (!strcmp(entry->host, host) && !strcmp(entry->port, port))
+			break;
+
+	if (!entry) {
+		entry = calloc(1, sizeof(*entry));
+		if (!entry)
+			return EAI_MEMORY;
+		entry->host = strdup(host);
+		entry->port = strdup(port);
+		if (!entry->host || !entry->port) {
+			free(entry->host);
+			free(entry->port);
+			free(entry);
+			return EAI_MEMORY;
+		}
+		entry->err = resolve_address(&entry->addr, host, port);
+		entry->next = *bucket;
+		*bucket = entry;
+	}
+
+	if (!entry->err)
+		*addr = entry->addr;
+	return entry->err;
+}
+
+void resolver_stop(struct resolver *r)
+{
+	struct resolved *entry;
+	int i;
+
+	for (i = 0; i < RESOLVER_BUCKETS; i++)
+		while ((entry = r->buckets[i])) {
+			r->buckets[i] = entry->next;
+			free(entry->host);
+			free(entry->port);
+			free(entry);
+		}
+	free(r);
+}
@@ -0,0 +1,22 @@
+#ifndef NET_H
+#define NET_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+int resolve_address(struct sockaddr_in *addr, const char *host,
+		    const char *port);
+int connect_to_peer(struct sockaddr_in *peeraddr, uint16_t bindport);
+int connect_nonblocking(struct sockaddr_in *peeraddr, int fastopen);
+int connect_finished(int sock);
+int send_all(int sock, char *data, size_t size);
+
+struct resolver;
+
+struct resolver *resolver_start(void);
+int resolver_lookup(struct resolver *r, struct sockaddr_in *addr,
+		    const char *host, const char *port);
+void resolver_stop(struct resolver *r);
+
+#endif
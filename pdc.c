@@ -0,0 +1,306 @@
+#include "pdc.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The reorder buffer is a ring of time slots indexed by frame sequence
+ * number, the count of frame periods since the epoch.  Every slot has room
+ * for one frame from each PMU, all allocated up front, so frames are merged
+ * without allocating.  Slots leave the ring strictly in time order, each
+ * once all PMUs have reported or its wait window has expired.
+ */
+
+struct pdc_slot {
+	uint64_t seq;
+	int arrived;
+	struct timespec deadline;
+	unsigned char *present;
+	c37_packet *pkts;
+};
+
+struct pdc_pmu {
+	unsigned long long frames;
+	unsigned long long late;
+	unsigned long long missing;
+};
+
+struct pdc {
+	uint16_t idcode;
+	int count;
+	int rate;
+	int wait;
+	int started;
+	int pending;
+	uint64_t head;
+	uint64_t nslots;
+	struct pdc_slot *slots;
+	struct pdc_pmu *pmus;
+	unsigned char *present;
+	c37_packet *pkts;
+	char *frame;
+	size_t framesize;
+
+	unsigned long long frames;
+	unsigned long long complete;
+	unsigned long long partial;
+	unsigned long long late;
+	unsigned long long duplicate;
+	unsigned long long early;
+	unsigned long long missing;
+};
+
+static uint64_t frame_seq(struct pdc *pdc, c37_packet *pkt)
+{
+	uint64_t frac = pkt->fracsec & 0xFFFFFF;
+
+	return (uint64_t)pkt->soc * pdc->rate +
+	    (frac * pdc->rate + TIME_BASE / 2) / TIME_BASE;
+}
+
+/* Counts every source as missing from timestamps that no source reported,
+ * which are passed over without sending anything.
+ */
+static void skip(struct pdc *pdc, uint64_t slots)
+{
+	int i;
+
+	for (i = 0; i < pdc->count; i++)
+		pdc->pmus[i].missing += slots;
+	pdc->missing += slots * pdc->count;
+}
+
+static int before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+struct pdc *pdc_start(uint16_t idcode, int count, int rate, int wait)
+{
+	struct pdc *pdc;
+	uint64_t i;
+	uint64_t needed;
+
+	pdc = calloc(1, sizeof(*pdc));
+	if (!pdc)
+		return NULL;
+
+	pdc->idcode = idcode;
+	pdc->count = count;
+	pdc->rate = rate;
+	pdc->wait = wait;
+
+	/* Leave room for a full wait window of frames behind the head, and as
+	 * many again for sources running ahead of it.
+	 */
+	needed = 2 * ((uint64_t)wait * rate / 1000 + 1);
+	for (pdc->nslots = 16; pdc->nslots < needed; pdc->nslots *= 2) ;
+
+	pdc->framesize = HEADER_SIZE + count * BLOCK_SIZE + CRC_SIZE;
+	pdc->slots = calloc(pdc->nslots, sizeof(*pdc->slots));
+	pdc->pmus = calloc(count, sizeof(*pdc->pmus));
+	pdc->present = calloc(pdc->nslots * count, sizeof(*pdc->present));
+	pdc->pkts = calloc(pdc->nslots * count, sizeof(*pdc->pkts));
+	pdc->frame = malloc(pdc->framesize);
+	if (!pdc->slots || !pdc->pmus || !pdc->present || !pdc->pkts ||
+	    !pdc->frame || pdc->framesize > 0xFFFF) {
+		pdc_stop(pdc);
+		return NULL;
+	}
+
+	for (i = 0; i < pdc->nslots; i++) {
+		pdc->slots[i].present = &pdc->present[i * count];
+		pdc->slots[i].pkts = &pdc->pkts[i * count];
+	}
+
+	return pdc;
+}
+
+/* Returns 0 if the frame was merged, or -1 if it was discarded as late,
+ * duplicate, or too far ahead of the frames still waiting.
+ */
+int pdc_add(struct pdc *pdc, int index, c37_packet *pkt,
+	    const struct timespec *now)
+{
+	struct pdc_slot *slot;
+	uint64_t seq;
+
+	seq = frame_seq(pdc, pkt);
+	pdc->pmus[index].frames++;
+
+	if (!pdc->pending && (!pdc->started || seq >= pdc->head)) {
+		if (pdc->started)
+			skip(pdc, seq - pdc->head);
+		pdc->head = seq;
+		pdc->started = 1;
+	}
+
+	if (seq < pdc->head) {
+		pdc->late++;
+		pdc->pmus[index].late++;
+		return -1;
+	}
+
+	if (seq >= pdc->head + pdc->nslots) {
+		pdc->early++;
+		return -1;
+	}
+
+	slot = &pdc->slots[seq & (pdc->nslots - 1)];
+	if (!slot->arrived) {
+		slot->seq = seq;
+		slot->deadline = *now;
+		slot->deadline.tv_sec += pdc->wait / 1000;
+		slot->deadline.tv_nsec += (pdc->wait % 1000) * 1000000L;
+		if (slot->deadline.tv_nsec >= 1000000000L) {
+			slot->deadline.tv_sec++;
+			slot->deadline.tv_nsec -= 1000000000L;
+		}
+		pdc->pending++;
+	} else if (slot->present[index]) {
+		pdc->duplicate++;
+		return -1;
+	}
+
+	slot->pkts[index] = *pkt;
+	slot->present[index] = 1;
+	slot->arrived++;
+	pdc->frames++;
+	return 0;
+}
+
+static size_t form_frame(struct pdc *pdc, struct pdc_slot *slot)
+{
+	c37_packet header;
+	c37_packet missing;
+	char *ptr;
+	int i;
+
+	memset(&header, 0, sizeof(header));
+	header.sync = SYNC_DATA;
+	header.framesize = pdc->framesize;
+	header.id_code = pdc->idcode;
+	header.soc = slot->seq / pdc->rate;
+	header.fracsec = (slot->seq % pdc->rate) * TIME_BASE / pdc->rate;
+
+	/* PMUs that never reported are marked invalid, with NaN data.
+	 */
+	memset(&missing, 0, sizeof(missing));
+	missing.stat = 0x8000;
+	missing.voltage_amplitude = NAN;
+	missing.voltage_angle = NAN;
+	missing.current_amplitude = NAN;
+	missing.current_angle = NAN;
+	missing.voltage_frequency = NAN;
+	missing.delta_frequency = NAN;
+
+	ptr = form_c37_header(pdc->frame, &header);
+	for (i = 0; i < pdc->count; i++) {
+		if (slot->present[i]) {
+			ptr = form_c37_block(ptr, &slot->pkts[i]);
+			slot->present[i] = 0;
+		} else {
+			ptr = form_c37_block(ptr, &missing);
+			pdc->pmus[i].missing++;
+			pdc->missing++;
+		}
+	}
+	header.crc = ComputeCRC((unsigned char *)pdc->frame,
+				pdc->framesize - CRC_SIZE);
+	put_big_endian(ptr, 2, (unsigned char *)&header.crc);
+
+	if (slot->arrived == pdc->count)
+		pdc->complete++;
+	else
+		pdc->partial++;
+	slot->arrived = 0;
+
+	return pdc->framesize;
+}
+
+/* Returns the size of the next combined frame that is ready to go out,
+ * or 0 if there is none yet.  Pass a NULL time to flush every slot.
+ */
+size_t pdc_next(struct pdc *pdc, const struct timespec *now, char **frame)
+{
+	struct pdc_slot *slot;
+	size_t size;
+
+	while (pdc->pending > 0) {
+		slot = &pdc->slots[pdc->head & (pdc->nslots - 1)];
+		if (!slot->arrived || slot->seq != pdc->head) {
+			skip(pdc, 1);
+			pdc->head++;
+			continue;
+		}
+
+		if (slot->arrived < pdc->count && now &&
+		    before(now, &slot->deadline))
+			return 0;
+
+		size = form_frame(pdc, slot);
+		pdc->pending--;
+		pdc->head++;
+		*frame = pdc->frame;
+		return size;
+	}
+
+	return 0;
+}
+
+/* Returns the number of milliseconds until the oldest waiting slot
+ * expires, or -1 if no slot is waiting, suitable for poll().
+ */
+int pdc_timeout(struct pdc *pdc, const struct timespec *now)
+{
+	struct pdc_slot *slot;
+	uint64_t seq;
+	long ms;
+
+	if (!pdc->pending)
+		return -1;
+
+	for (seq = pdc->head;; seq++) {
+		slot = &pdc->slots[seq & (pdc->nslots - 1)];
+		if (slot->arrived && slot->seq == seq)
+			break;
+	}
+
+	if (slot->arrived == pdc->count || !before(now, &slot->deadline))
+		return 0;
+
+	ms = (slot->deadline.tv_sec - now->tv_sec) * 1000 +
+	    (slot->deadline.tv_nsec - now->tv_nsec) / 1000000;
+	return ms + 1;
+}
+
+void pdc_report(struct pdc *pdc, FILE *output)
+{
+	int i;
+
+	fprintf(output, "pdc: %llu frames in, %llu out (%llu complete, "
+		"%llu partial), %llu late, %llu duplicate, %llu early, "
+		"%llu missing\n", pdc->frames, pdc->complete + pdc->partial,
+		pdc->complete, pdc->partial, pdc->late, pdc->duplicate,
+		pdc->early, pdc->missing);
+
+	for (i = 0; i < pdc->count; i++)
+		fprintf(output, "pdc: source %d: %llu frames, %llu late, "
+			"%llu missing\n", i, pdc->pmus[i].frames,
+			pdc->pmus[i].late, pdc->pmus[i].missing);
+}
+
+void pdc_stop(struct pdc *pdc)
+{
+	free(pdc->frame);
+	free(pdc->pkts);
+	free(pdc->present);
+	free(pdc->pmus);
+	free(pdc->slots);
+	free(pdc);
+}
@@ -0,0 +1,19 @@
+#ifndef PDC_H
+#define PDC_H
+
+#include "c37.h"
+
+#include <stdio.h>
+#include <time.h>
+
+struct pdc;
+
+struct pdc *pdc_start(uint16_t idcode, int count, int rate, int wait);
+int pdc_add(struct pdc *pdc, int index, c37_packet *pkt,
+	    const struct timespec *now);
+size_t pdc_next(struct pdc *pdc, const struct timespec *now, char **frame);
+int pdc_timeout(struct pdc *pdc, const struct timespec *now);
+void pdc_report(struct pdc *pdc, FILE *output);
+void pdc_stop(struct pdc *pdc);
+
+#endif
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "c37.h"
+#include "mux.h"
+
+#define DFL_PORT	3360
+#define CONN_BUFFER	(MUX_HEADER_SIZE + MUX_MAX_PAYLOAD)
+
+/* Global stuff gleaned from program arguments.
+ */
+struct prog_args {
+	char *name;
+	char *port;
+	int quiet;
+} prog_args;
+
+/* A stream is owned by the connection it was last opened on.  When dc moves
+ * a stream between workers, it may be opened on a new connection before
+ * the close arrives on the old one; data on the new connection is held
+ * until then, so frames come out in order.
+ */
+struct stream {
+	char *name;
+	int owner;
+	int next;
+	int nextclosed;
+	unsigned long frames;
+	char *buf;
+	size_t len;
+	char *held;
+	size_t heldlen;
+};
+
+struct conn {
+	int fd;
+	char buf[CONN_BUFFER];
+	size_t len;
+};
+
+struct stream *streams;
+unsigned int nstreams;
+
+static void usage(){
+	fprintf(stderr, "Usage: %s [args]\n", prog_args.name);
+	fprintf(stderr, "Optional arguments:\n");
+	fprintf(stderr, "	-p port: TCP server port [default = %d]\n", DFL_PORT);
+	fprintf(stderr, "	-q: print only a frame count for each stream\n");
+	exit(1);
+}
+
+static char *append(char *buf, size_t *len, char *data, size_t n){
+	buf = realloc(buf, *len + n);
+	if (buf == 0) {
+		fprintf(stderr, "%s: out of memory\n", prog_args.name);
+		exit(1);
+	}
+	memcpy(&buf[*len], data, n);
+	*len += n;
+	return buf;
+}
+
+/* Print each complete frame the stream now holds.
+ */
+static void feed(struct stream *s, char *data, size_t n){
+	size_t off = 0;
+	int size;
+
+	s->buf = append(s->buf, &s->len, data, n);
+	while ((size = c37_frame_size(&s->buf[off], s->len - off)) > 0 &&
+			(size_t) size <= s->len - off) {
+		s->frames++;
+		if (!prog_args.quiet) {
+			if (size == FRAME_SIZE && c37_is_data(&s->buf[off])) {
+				c37_packet pkt;
+				parse_c37_packet(&pkt, &s->buf[off]);
+				printf("%s: ", s->name);
+				write_c37_packet_readable(stdout, &pkt);
+			} else {
+				printf("%s: %d-byte frame\n", s->name, size);
+			}
+		}
+		off += size;
+	}
+	if (size < 0) {
+		fprintf(stderr, "%s: %s: bad frame\n", prog_args.name, s->name);
+		s->len = off = 0;
+	}
+	memmove(s->buf, &s->buf[off], s->len - off);
+	s->len -= off;
+}
+
+static void finish(struct stream *s){
+	if (prog_args.quiet) {
+		printf("%s: %lu frames\n", s->name, s->frames);
+	}
+	s->owner = -1;
+	s->len = 0;
+}
+
+/* The stream's owner is done with it, by CLOSE or by dropping the
+ * connection; any connection it was moving to takes over.
+ */
+static void release(struct stream *s){
+	if (s->next < 0) {
+		finish(s);
+		return;
+	}
+	s->owner = s->next;
+	s->next = -1;
+	feed(s, s->held, s->heldlen);
+	s->heldlen = 0;
+	if (s->nextclosed) {
+		finish(s);
+	}
+}
+
+/* The connection a stream was moving to dropped before taking over, so
+ * whatever it sent is lost.
+ */
+static void abandon(struct stream *s){
+	s->next = -1;
+	s->nextclosed = 0;
+	free(s->held);
+	s->held = 0;
+	s->heldlen = 0;
+}
+
+static struct stream *get_stream(unsigned int number){
+	if (number >= nstreams) {
+		streams = realloc(streams, (number + 1) * sizeof(*streams));
+		if (streams == 0) {
+			fprintf(stderr, "%s: out of memory\n", prog_args.name);
+			exit(1);
+		}
+		memset(&streams[nstreams], 0, (number + 1 - nstreams) * sizeof(*streams));
+		for (; nstreams <= number; nstreams++) {
+			streams[nstreams].owner = -1;
+			streams[nstreams].next = -1;
+		}
+	}
+	return &streams[number];
+}
+
+static void do_chunk(int c, struct mux_chunk *chunk){
+	struct stream *s = get_stream(chunk->stream);
+
+	switch (chunk->type) {
+		case MUX_OPEN:
+			free(s->name);
+			if ((s->name = strndup(chunk->payload, chunk->length)) == 0) {
+				fprintf(stderr, "%s: out of memory\n", prog_args.name);
+				exit(1);
+			}
+			if (s->owner < 0) {
+				s->owner = c;
+			} else {
+				s->next = c;
+				s->nextclosed = 0;
+			}
+			break;
+		case MUX_DATA:
+			if (s->owner == c) {
+				feed(s, chunk->payload, chunk->length);
+			} else if (s->next == c) {
+				s->held = append(s->held, &s->heldlen, chunk->payload, chunk->length);
+			} else {
+				fprintf(stderr, "%s: data for unopened stream %u\n",
+								prog_args.name, chunk->stream);
+			}
+			break;
+		case MUX_CLOSE:
+			if (s->owner == c) {
+				release(s);
+			} else if (s->next == c) {
+				s->nextclosed = 1;
+			}
+			break;
+	}
+}
+
+/* Returns 0 when the connection has closed.
+ */
+static int do_read(int c, struct conn *conn){
+	struct mux_chunk chunk;
+	size_t off = 0;
+	int size;
+
+	int n = read(conn->fd, &conn->buf[conn->len], sizeof(conn->buf) - conn->len);
+	if (n <= 0) {
+		if (n < 0) {
+			perror("do_read: read");
+		}
+		return 0;
+	}
+	conn->len += n;
+
+	while ((size = mux_parse(&conn->buf[off], conn->len - off, &chunk)) > 0) {
+		do_chunk(c, &chunk);
+		off += size;
+	}
+	memmove(conn->buf, &conn->buf[off], conn->len - off);
+	conn->len -= off;
+	return 1;
+}
+
+void do_recv(int s){
+	struct pollfd *fds = 0;
+	struct conn **conns = 0;
+	int nconns = 0;
+
+	if (listen(s, 128) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	printf("Waiting for connections...\n");
+
+	for (;;) {
+		/* The listening socket goes last.
+		 */
+		fds = realloc(fds, (nconns + 1) * sizeof(*fds));
+		if (fds == 0) {
+			fprintf(stderr, "%s: out of memory\n", prog_args.name);
+			exit(1);
+		}
+		int i;
+		for (i = 0; i < nconns; i++) {
+			fds[i].fd = conns[i] ? conns[i]->fd : -1;
+			fds[i].events = POLLIN;
+		}
+		fds[nconns].fd = s;
+		fds[nconns].events = POLLIN;
+
+		if (poll(fds, nconns + 1, -1) < 0) {
+			perror("poll");
+			exit(1);
+		}
+
+		for (i = 0; i < nconns; i++) {
+			if (fds[i].revents == 0 || do_read(i, conns[i])) {
+				continue;
+			}
+			printf("Connection closed...\n");
+			close(conns[i]->fd);
+			free(conns[i]);
+			conns[i] = 0;
+
+			unsigned int j;
+			for (j = 0; j < nstreams; j++) {
+				if (streams[j].owner == i) {
+					release(&streams[j]);
+				} else if (streams[j].next == i) {
+					abandon(&streams[j]);
+				}
+			}
+		}
+
+		if (fds[nconns].revents) {
+			int fd = accept(s, 0, 0);
+			if (fd < 0) {
+				perror("accept");
+				exit(1);
+			}
+
+			/* Reuse the slot of a closed connection if there is one.
+			 */
+			for (i = 0; i < nconns && conns[i] != 0; i++) {
+			}
+			if (i == nconns) {
+				conns = realloc(conns, (nconns + 1) * sizeof(*conns));
+				if (conns == 0) {
+					fprintf(stderr, "%s: out of memory\n", prog_args.name);
+					exit(1);
+				}
+				nconns++;
+			}
+			if ((conns[i] = calloc(1, sizeof(**conns))) == 0) {
+				fprintf(stderr, "%s: out of memory\n", prog_args.name);
+				exit(1);
+			}
+			conns[i]->fd = fd;
+			printf("Got connection...\n");
+		}
+		fflush(stdout);
+	}
+}
+
+static void get_args(int argc, char *argv[]){
+	prog_args.name = argv[0];
+
+	int c;
+	while ((c = getopt(argc, argv, "p:q")) != -1) {
+		switch (c) {
+			case 'p':
+				if (prog_args.port != 0) {
+					fprintf(stderr, "%s: can specify only one port\n", prog_args.name);
+					exit(1);
+				}
+				if ((prog_args.port = optarg) == 0) {
+					fprintf(stderr, "%s: -p takes a port argument\n", prog_args.name);
+					exit(1);
+				}
+				break;
+			case 'q':
+				prog_args.quiet = 1;
+				break;
+			case '?':
+			default:
+				usage();
+		}
+	}
+
+	/* Get the remaining args.
+	 */
+	if (argc - optind != 0) {
+		usage();
+	}
+}
+
+/* Listen for multiplexed connections from dc -m, and print the frames of
+ * every stream they carry.
+ */
+int main(int argc, char *argv[]){
+	get_args(argc, argv);
+
+	int port = DFL_PORT;
+	if (prog_args.port != 0) {
+		if ((port = atoi(prog_args.port)) <= 0) {
+			fprintf(stderr, "%s: port must be positive integer\n", prog_args.name);
+			exit(1);
+		}
+	}
+
+	/* Create and bind the socket.
+	 */
+	int s;
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+
+	do_recv(s);
+	return 0;
+}
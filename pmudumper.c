@@ -1,86 +1,283 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include "c37.h"
 
 #define DFL_PORT	3360
+#define READ_SIZE	65536
+#define MAX_EVENTS	256
 
 /* Global stuff gleaned from program arguments.
  */
 struct prog_args {
 	char *name;
 	char *port;
+	int quiet;
+	int interval;
 } prog_args;
 
+/* Frame counts and ages, in microseconds behind the local clock, for one
+ * connection or for all of them.
+ */
+struct stats {
+	unsigned long long frames;
+	unsigned long long bytes;
+	long long agesum;
+	long long agemin;
+	long long agemax;
+};
+
+/* Between reads, a connection keeps only its partial frame, if any.
+ */
+struct conn {
+	int fd;
+	int number;
+	struct timespec start;
+	struct stats stats;
+	char *partial;
+	size_t len;
+};
+
+static char readbuf[2 * READ_SIZE];
+static struct stats interval_stats;
+static int nconns;
+
+/* A descriptor held in reserve, so that a connection can still be
+ * accepted and turned away once the descriptors run out.
+ */
+static int spare = -1;
+
 static void usage(){
 	fprintf(stderr, "Usage: %s [args]\n", prog_args.name);
-	fprintf(stderr, "Optional argument:\n");
+	fprintf(stderr, "Optional arguments:\n");
 	fprintf(stderr, "	-p port: TCP server port [default = %d]\n", DFL_PORT);
+	fprintf(stderr, "	-q: print only statistics for each connection as it closes\n");
+	fprintf(stderr, "	-i interval: seconds between statistics for all connections\n");
 	exit(1);
 }
 
-int do_copy(int fd){
-	FILE *input = fdopen(fd, "r");
-	if (input == 0) {
-		fprintf(stderr, "%s: fdopen failed\n", prog_args.name);
-		exit(1);
+static double seconds(struct timespec *from, struct timespec *to){
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void count(struct stats *stats, size_t size, long long age){
+	if (stats->frames == 0 || age < stats->agemin) {
+		stats->agemin = age;
+	}
+	if (stats->frames == 0 || age > stats->agemax) {
+		stats->agemax = age;
 	}
+	stats->frames++;
+	stats->bytes += size;
+	stats->agesum += age;
+}
 
-	/* Copy input.
-	 */
-	while (!feof(input)) {
-		/* Read one frame.
-		 */
-		char buf[FRAME_SIZE];
-		int n = fread(buf, FRAME_SIZE, 1, input);
-		if (n == 0) {
-			break;
+static void print_stats(char *what, struct stats *stats, double elapsed){
+	printf("%s: %llu frames, %llu bytes in %.3f s, %.1f frames/s", what,
+			stats->frames, stats->bytes, elapsed,
+			elapsed > 0 ? stats->frames / elapsed : 0);
+	if (stats->frames > 0) {
+		printf(", age %.3f ms mean, %.3f min, %.3f max",
+				stats->agesum / 1e3 / stats->frames,
+				stats->agemin / 1e3, stats->agemax / 1e3);
+	}
+	printf("\n");
+}
+
+/* Handle every complete frame in the buffer, and return how many bytes
+ * they took.
+ */
+static size_t do_frames(struct conn *c, char *buf, size_t len){
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long usec = (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+	size_t off = 0;
+	int size;
+	while ((size = c37_frame_size(&buf[off], len - off)) > 0 &&
+			(size_t) size <= len - off) {
+		c37_packet pkt;
+		parse_c37_header(&pkt, &buf[off]);
+		long long age = usec - ((long long) pkt.soc * 1000000 +
+				(long long) (pkt.fracsec & 0xFFFFFF) * 1000000 / TIME_BASE);
+		count(&c->stats, size, age);
+		count(&interval_stats, size, age);
+
+		if (!prog_args.quiet) {
+			if (size == FRAME_SIZE && c37_is_data(&buf[off])) {
+				parse_c37_packet(&pkt, &buf[off]);
+				write_c37_packet_readable(stdout, &pkt);
+			} else {
+				printf("%d-byte frame\n", size);
+			}
 		}
-		if (n < 0) {
-			perror("do_copy: fread");
+		off += size;
+	}
+	if (size < 0) {
+		fprintf(stderr, "%s: connection %d: bad frame\n", prog_args.name, c->number);
+		return len;
+	}
+	return off;
+}
+
+static void do_close(int epfd, struct conn *c){
+	if (prog_args.quiet) {
+		struct timespec now;
+		char what[32];
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		snprintf(what, sizeof(what), "connection %d", c->number);
+		print_stats(what, &c->stats, seconds(&c->start, &now));
+	} else {
+		printf("Connection closed...\n");
+	}
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, 0);
+	close(c->fd);
+	free(c->partial);
+	free(c);
+	nconns--;
+}
+
+/* Read what the connection has, in bulk, and keep any partial frame for
+ * next time.
+ */
+static void do_read(int epfd, struct conn *c){
+	if (c->len > 0) {
+		memcpy(readbuf, c->partial, c->len);
+	}
+	ssize_t n = recv(c->fd, &readbuf[c->len], READ_SIZE, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		do_close(epfd, c);
+		return;
+	}
+
+	size_t len = c->len + n;
+	size_t used = do_frames(c, readbuf, len);
+	c->len = len - used;
+	if (c->len > 0) {
+		if ((c->partial = realloc(c->partial, c->len)) == 0) {
+			fprintf(stderr, "%s: out of memory\n", prog_args.name);
 			exit(1);
 		}
+		memcpy(c->partial, &readbuf[used], c->len);
+	}
+}
 
-		/* Convert the frame.
-		 */
-		c37_packet *pkt = get_c37_packet(buf);
-		if (pkt == 0) {
-			fprintf(stderr, "%s: do_copy: bad packet\n", prog_args.name);
+static void do_accept(int epfd, int s){
+	static int number;
+	int fd;
+
+	while ((fd = accept4(s, 0, 0, SOCK_NONBLOCK)) >= 0) {
+		struct conn *c = calloc(1, sizeof(*c));
+		if (c == 0) {
+			fprintf(stderr, "%s: out of memory\n", prog_args.name);
 			exit(1);
 		}
-		if (pkt->framesize != FRAME_SIZE) {
-			fprintf(stderr, "%s: do_copy: bad frame size\n", prog_args.name);
+		c->fd = fd;
+		c->number = number++;
+		clock_gettime(CLOCK_MONOTONIC, &c->start);
+
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			perror("epoll_ctl");
 			exit(1);
 		}
-
-		/* Write the packet to standard output.
+		nconns++;
+		if (!prog_args.quiet) {
+			printf("Got connection...\n");
+		}
+	}
+	if (errno == EMFILE || errno == ENFILE) {
+		/* Otherwise the listening socket stays ready, and epoll
+		 * returns it again at once, for good.
 		 */
-		write_c37_packet_readable(stdout, pkt);
-		free(pkt);
+		perror("accept");
+		if (spare >= 0) {
+			close(spare);
+			while ((fd = accept(s, 0, 0)) >= 0) {
+				close(fd);
+			}
+			spare = open("/dev/null", O_RDONLY);
+		}
+	} else if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+		perror("accept");
+		exit(1);
 	}
-
-	fclose(input);
-
-	return 1;
 }
 
+/* Serve every connection at once from one epoll loop.  The listening
+ * socket is marked with a null pointer.
+ */
 void do_recv(int s){
-	int fd;
+	if (listen(s, SOMAXCONN) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+	int epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = 0;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s, &event) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+
+	spare = open("/dev/null", O_RDONLY);
+
+	printf("Waiting for connections...\n");
+	fflush(stdout);
+
+	struct timespec last, now;
+	clock_gettime(CLOCK_MONOTONIC, &last);
 	for (;;) {
-		if (listen(s, 1) < 0) {
-			perror("listen");
+		struct epoll_event events[MAX_EVENTS];
+		int timeout = prog_args.interval ? 100 : -1;
+		int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
 			exit(1);
 		}
-		printf("Waiting for connection...\n");
-		if ((fd = accept(s, 0, 0)) < 0) {
-			perror("accept");
-			exit(1);
+
+		int i;
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == 0) {
+				do_accept(epfd, s);
+			} else {
+				do_read(epfd, events[i].data.ptr);
+			}
 		}
 
-		printf("Got connection...\n");
-		do_copy(fd);
-		printf("Connection closed...\n");
+		if (prog_args.interval) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			double elapsed = seconds(&last, &now);
+			if (elapsed >= prog_args.interval) {
+				char what[32];
+				snprintf(what, sizeof(what), "%d connections", nconns);
+				print_stats(what, &interval_stats, elapsed);
+				memset(&interval_stats, 0, sizeof(interval_stats));
+				last = now;
+			}
+		}
+		fflush(stdout);
 	}
 }
 
@@ -88,8 +285,14 @@ static void get_args(int argc, char *argv[]){
 	prog_args.name = argv[0];
 
 	int c;
-	while ((c = getopt(argc, argv, "p:")) != -1) {
+	while ((c = getopt(argc, argv, "i:p:q")) != -1) {
 		switch (c) {
+			case 'i':
+				if ((prog_args.interval = atoi(optarg)) <= 0) {
+					fprintf(stderr, "%s: interval must be positive integer\n", prog_args.name);
+					exit(1);
+				}
+				break;
 			case 'p':
 				if (prog_args.port != 0) {
 					fprintf(stderr, "%s: can specify only one port\n", prog_args.name);
@@ -100,6 +303,9 @@ static void get_args(int argc, char *argv[]){
 					exit(1);
 				}
 				break;
+			case 'q':
+				prog_args.quiet = 1;
+				break;
 			case '?':
 			default:
 				usage();
@@ -113,8 +319,7 @@ static void get_args(int argc, char *argv[]){
 	}
 }
 
-/* If called without arguments, listen for connections.  Otherwise make a
- * connection to the specified first argument.
+/* Listen for connections, as many at once as the descriptor limit allows.
  */
 int main(int argc, char *argv[]){
 	get_args(argc, argv);
@@ -127,6 +332,14 @@ int main(int argc, char *argv[]){
 		}
 	}
 
+	/* Raise the descriptor limit as far as allowed.
+	 */
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
 	/* Create and bind the socket.
 	 */
 	int s;
@@ -134,6 +347,8 @@ int main(int argc, char *argv[]){
 		perror("socket");
 		exit(1);
 	}
+	int yes = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 
 	struct sockaddr_in addr;
 	addr.sin_family = AF_INET;
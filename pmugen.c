@@ -0,0 +1,501 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "c37.h"
+#include "net.h"
+
+#define DFL_PORT	3350
+#define MAX_BATCH	64
+
+/* Seconds per cycle of the frequency excursion.
+ */
+#define EXCURSION_PERIOD	20.0
+
+/* Global stuff gleaned from program arguments.
+ */
+struct prog_args {
+	char *name;
+	char *port;
+	char *udp;
+	int count;
+	int base;
+	int rate;
+	int duration;
+	double fnom;
+	double excursion;
+	double noise;
+	double gap;
+	double crc;
+	double stat;
+} prog_args;
+
+/* One synthetic PMU, fed either to its own TCP connection or to the UDP
+ * destination shared by all of them.
+ */
+struct pmu {
+	uint16_t id;
+	int fd;
+	int ready;
+	uint64_t rng;
+	double phase;
+	double offset;
+	double lag;
+	double frequency;
+	char pending[FRAME_SIZE];
+	int npending;
+};
+
+static struct pmu *pmus;
+static int npmus;
+
+/* What was generated, in frames.
+ */
+static struct {
+	unsigned long long frames;
+	unsigned long long gaps;
+	unsigned long long crcs;
+	unsigned long long flagged;
+	unsigned long long dropped;
+	unsigned long long late;
+} stats;
+
+static const uint16_t stat_flags[] = { 0x8000, 0x4000, 0x2000 };
+
+static void usage(){
+	fprintf(stderr, "Usage: %s [args]\n", prog_args.name);
+	fprintf(stderr, "Optional arguments:\n");
+	fprintf(stderr, "	-p port: TCP server port [default = %d]\n", DFL_PORT);
+	fprintf(stderr, "	-u host:port: send UDP datagrams there instead\n");
+	fprintf(stderr, "	-n pmus: PMUs to send over UDP [default = 1]\n");
+	fprintf(stderr, "	-i id: first id_code over UDP [default = 1]\n");
+	fprintf(stderr, "	-r rate: frames per second, 10 to 240 [default = 30]\n");
+	fprintf(stderr, "	-d seconds: stop after [default = never]\n");
+	fprintf(stderr, "	-F hz: nominal frequency [default = 60]\n");
+	fprintf(stderr, "	-e hz: frequency excursion [default = 0.05]\n");
+	fprintf(stderr, "	-N noise: relative noise on phasors [default = 0.001]\n");
+	fprintf(stderr, "	-x faults: gap:P,crc:P,stat:P chance per frame\n");
+	exit(1);
+}
+
+/* xorshift64*, seeded per PMU so runs repeat.
+ */
+static double uniform(struct pmu *p){
+	p->rng ^= p->rng >> 12;
+	p->rng ^= p->rng << 25;
+	p->rng ^= p->rng >> 27;
+	return ((p->rng * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+/* Near enough to a unit normal for noise, and much cheaper than the real
+ * thing.
+ */
+static double gaussian(struct pmu *p){
+	return (uniform(p) + uniform(p) + uniform(p) + uniform(p) - 2) * sqrt(3);
+}
+
+static double wrap(double angle){
+	while (angle > M_PI) {
+		angle -= 2 * M_PI;
+	}
+	while (angle <= -M_PI) {
+		angle += 2 * M_PI;
+	}
+	return angle;
+}
+
+static void start_pmu(struct pmu *p, uint16_t id){
+	p->id = id;
+	p->rng = 0x9E3779B97F4A7C15ULL * (id + 1);
+	p->offset = 2 * M_PI * uniform(p);
+	p->phase = wrap(2 * M_PI * uniform(p));
+	p->lag = 0.1 + 0.4 * uniform(p);
+	p->frequency = prog_args.fnom;
+	p->ready = 1;
+}
+
+/* Fills in the PMU's frame for time t, advancing its phase by one period.
+ * Returns 0 if the frame is to go missing.
+ */
+static int synthesize(struct pmu *p, const struct timespec *t, char *buf){
+	double period = 1.0 / prog_args.rate;
+	double noise = prog_args.noise;
+	double now = t->tv_sec + t->tv_nsec / 1e9;
+	double f = prog_args.fnom + prog_args.excursion *
+			sin(2 * M_PI * now / EXCURSION_PERIOD + p->offset);
+
+	p->phase = wrap(p->phase + 2 * M_PI * (f - prog_args.fnom) * period);
+	double dfdt = (f - p->frequency) / period;
+	p->frequency = f;
+
+	if (prog_args.gap > 0 && uniform(p) < prog_args.gap) {
+		stats.gaps++;
+		return 0;
+	}
+
+	c37_packet pkt;
+	pkt.sync = SYNC_DATA;
+	pkt.framesize = FRAME_SIZE;
+	pkt.id_code = p->id;
+	pkt.soc = t->tv_sec;
+	pkt.fracsec = t->tv_nsec / 1000;
+	pkt.stat = 0;
+	pkt.voltage_amplitude = 1 + noise * gaussian(p);
+	pkt.voltage_angle = wrap(p->phase + noise * gaussian(p));
+	pkt.current_amplitude = 9 * (1 + noise * gaussian(p));
+	pkt.current_angle = wrap(p->phase - p->lag + noise * gaussian(p));
+	pkt.voltage_frequency = f;
+	pkt.delta_frequency = dfdt;
+	if (prog_args.stat > 0 && uniform(p) < prog_args.stat) {
+		pkt.stat = stat_flags[(int) (uniform(p) * 3)];
+		stats.flagged++;
+	}
+
+	form_c37_packet(buf, &pkt);
+	if (prog_args.crc > 0 && uniform(p) < prog_args.crc) {
+		buf[FRAME_SIZE - 1] ^= 0xFF;
+		stats.crcs++;
+	}
+	stats.frames++;
+	return 1;
+}
+
+static void close_pmu(struct pmu *p){
+	close(p->fd);
+	*p = pmus[--npmus];
+}
+
+/* Accepts new connections.  Each names its PMU's id_code by the stream-id
+ * it sends, as to a real PMU.
+ */
+static void do_accept(int s){
+	int fd;
+	int yes = 1;
+
+	while ((fd = accept4(s, 0, 0, SOCK_NONBLOCK)) >= 0) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		if ((pmus = realloc(pmus, (npmus + 1) * sizeof(*pmus))) == 0) {
+			fprintf(stderr, "%s: out of memory\n", prog_args.name);
+			exit(1);
+		}
+		memset(&pmus[npmus], 0, sizeof(*pmus));
+		pmus[npmus++].fd = fd;
+	}
+	if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+		perror("accept");
+	}
+}
+
+static int do_id(struct pmu *p){
+	char id[32];
+	ssize_t n = recv(p->fd, id, sizeof(id) - 1, MSG_DONTWAIT);
+	if (n < 0) {
+		return errno == EAGAIN ? 1 : -1;
+	}
+	if (n == 0) {
+		return -1;
+	}
+	id[n] = '\0';
+	start_pmu(p, atoi(id));
+	return 1;
+}
+
+/* Sends without blocking, finishing any partly sent frame first, so that
+ * one slow connection costs only its own frames.
+ */
+static int do_send(struct pmu *p, char *buf){
+	ssize_t n;
+
+	if (p->npending > 0) {
+		n = send(p->fd, &p->pending[FRAME_SIZE - p->npending], p->npending,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno != EAGAIN) {
+			return -1;
+		}
+		if (n > 0) {
+			p->npending -= n;
+		}
+		if (p->npending > 0) {
+			stats.dropped++;
+			return 0;
+		}
+	}
+
+	n = send(p->fd, buf, FRAME_SIZE, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0 && errno != EAGAIN) {
+		return -1;
+	}
+	if (n < 0) {
+		stats.dropped++;
+	} else if (n < FRAME_SIZE) {
+		memcpy(p->pending, buf, FRAME_SIZE);
+		p->npending = FRAME_SIZE - n;
+	}
+	return 0;
+}
+
+static void do_tcp(int s, const struct timespec *t){
+	char buf[FRAME_SIZE];
+	int i;
+
+	do_accept(s);
+	for (i = 0; i < npmus; i++) {
+		struct pmu *p = &pmus[i];
+		if ((!p->ready && do_id(p) < 0) ||
+				(p->ready && synthesize(p, t, buf) &&
+				 do_send(p, buf) < 0)) {
+			close_pmu(p);
+			i--;
+		}
+	}
+}
+
+/* Sends every PMU's frame in batches of datagrams.
+ */
+static void do_udp(int s, const struct timespec *t){
+	static char bufs[MAX_BATCH][FRAME_SIZE];
+	static struct iovec iovs[MAX_BATCH];
+	static struct mmsghdr msgs[MAX_BATCH];
+	int n = 0;
+	int i;
+
+	for (i = 0; i <= npmus; i++) {
+		if (i < npmus && synthesize(&pmus[i], t, bufs[n])) {
+			iovs[n].iov_base = bufs[n];
+			iovs[n].iov_len = FRAME_SIZE;
+			msgs[n].msg_hdr.msg_iov = &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			n++;
+		}
+		if (n == MAX_BATCH || (i == npmus && n > 0)) {
+			int sent = sendmmsg(s, msgs, n, 0);
+			if (sent < 0) {
+				sent = 0;
+			}
+			stats.dropped += n - sent;
+			n = 0;
+		}
+	}
+}
+
+static void parse_faults(char *spec){
+	char *item;
+	char *save;
+	char *end;
+
+	for (item = strtok_r(spec, ",", &save); item;
+			item = strtok_r(0, ",", &save)) {
+		double *chance;
+		if (!strncmp(item, "gap:", 4)) {
+			chance = &prog_args.gap;
+		} else if (!strncmp(item, "crc:", 4)) {
+			chance = &prog_args.crc;
+		} else if (!strncmp(item, "stat:", 5)) {
+			chance = &prog_args.stat;
+		} else {
+			usage();
+		}
+		*chance = strtod(strchr(item, ':') + 1, &end);
+		if (*end || *chance < 0 || *chance > 1) {
+			usage();
+		}
+	}
+}
+
+static void get_args(int argc, char *argv[]){
+	prog_args.name = argv[0];
+	prog_args.count = 1;
+	prog_args.base = 1;
+	prog_args.rate = 30;
+	prog_args.fnom = 60;
+	prog_args.excursion = 0.05;
+	prog_args.noise = 0.001;
+
+	int c;
+	while ((c = getopt(argc, argv, "F:N:d:e:i:n:p:r:u:x:")) != -1) {
+		switch (c) {
+			case 'p':
+				prog_args.port = optarg;
+				break;
+			case 'u':
+				prog_args.udp = optarg;
+				break;
+			case 'n':
+				if ((prog_args.count = atoi(optarg)) <= 0) {
+					usage();
+				}
+				break;
+			case 'i':
+				if ((prog_args.base = atoi(optarg)) < 0 ||
+						prog_args.base > 0xFFFF) {
+					usage();
+				}
+				break;
+			case 'r':
+				prog_args.rate = atoi(optarg);
+				if (prog_args.rate < 10 || prog_args.rate > 240) {
+					usage();
+				}
+				break;
+			case 'd':
+				if ((prog_args.duration = atoi(optarg)) <= 0) {
+					usage();
+				}
+				break;
+			case 'F':
+				if ((prog_args.fnom = atof(optarg)) <= 0) {
+					usage();
+				}
+				break;
+			case 'e':
+				if ((prog_args.excursion = atof(optarg)) < 0) {
+					usage();
+				}
+				break;
+			case 'N':
+				if ((prog_args.noise = atof(optarg)) < 0) {
+					usage();
+				}
+				break;
+			case 'x':
+				parse_faults(optarg);
+				break;
+			case '?':
+			default:
+				usage();
+		}
+	}
+
+	/* Get the remaining args.
+	 */
+	if (argc - optind != 0 || (prog_args.udp && prog_args.port) ||
+			(!prog_args.udp && prog_args.count != 1)) {
+		usage();
+	}
+}
+
+static int open_tcp(){
+	int port = DFL_PORT;
+	if (prog_args.port != 0) {
+		if ((port = atoi(prog_args.port)) <= 0) {
+			fprintf(stderr, "%s: port must be positive integer\n", prog_args.name);
+			exit(1);
+		}
+	}
+
+	int s;
+	if ((s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	int yes = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	if (listen(s, SOMAXCONN) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	printf("Waiting for connections...\n");
+	return s;
+}
+
+static int open_udp(){
+	char *port = strrchr(prog_args.udp, ':');
+	if (port == 0) {
+		usage();
+	}
+	*port++ = '\0';
+
+	struct sockaddr_in addr;
+	int err = resolve_address(&addr, prog_args.udp, port);
+	if (err) {
+		fprintf(stderr, "%s:%s: %s\n", prog_args.udp, port, gai_strerror(err));
+		exit(1);
+	}
+
+	int s;
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	npmus = prog_args.count;
+	if ((pmus = calloc(npmus, sizeof(*pmus))) == 0) {
+		fprintf(stderr, "%s: out of memory\n", prog_args.name);
+		exit(1);
+	}
+	int i;
+	for (i = 0; i < npmus; i++) {
+		start_pmu(&pmus[i], prog_args.base + i);
+	}
+	printf("Sending %d PMUs to %s:%s...\n", npmus, prog_args.udp, port);
+	return s;
+}
+
+/* Synthesize frames for many PMUs at once, each tick of the frame rate on
+ * the real-time clock, starting on a whole second.
+ */
+int main(int argc, char *argv[]){
+	get_args(argc, argv);
+
+	int s = prog_args.udp ? open_udp() : open_tcp();
+	fflush(stdout);
+
+	struct timespec start;
+	clock_gettime(CLOCK_REALTIME, &start);
+	start.tv_sec++;
+	start.tv_nsec = 0;
+
+	long long ticks = (long long) prog_args.duration * prog_args.rate;
+	long long k;
+	for (k = 0; ticks == 0 || k < ticks; k++) {
+		long long ns = k * 1000000000LL / prog_args.rate;
+		struct timespec t;
+		t.tv_sec = start.tv_sec + ns / 1000000000LL;
+		t.tv_nsec = ns % 1000000000LL;
+		while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &t, 0) == EINTR)
+			;
+
+		if (prog_args.udp) {
+			do_udp(s, &t);
+		} else {
+			do_tcp(s, &t);
+		}
+
+		/* Count ticks that took longer than their period.
+		 */
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if ((now.tv_sec - t.tv_sec) * 1000000000LL + now.tv_nsec - t.tv_nsec >
+				1000000000LL / prog_args.rate) {
+			stats.late++;
+		}
+	}
+
+	printf("%s: %llu frames, %llu gaps, %llu bad CRCs, %llu flagged, "
+			"%llu dropped, %llu late ticks\n", prog_args.name,
+			stats.frames, stats.gaps, stats.crcs, stats.flagged,
+			stats.dropped, stats.late);
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "c37.h"
+#include "shmring.h"
+
+#define MAX_FRAME	65536
+
+/* Global stuff gleaned from program arguments.
+ */
+struct prog_args {
+	char *name;
+	char *ring;
+	int quiet;
+	int spin;
+} prog_args;
+
+static void usage(){
+	fprintf(stderr, "Usage: %s [args] ring\n", prog_args.name);
+	fprintf(stderr, "Optional arguments:\n");
+	fprintf(stderr, "	-q: print only frame counts when the ring closes\n");
+	fprintf(stderr, "	-s: poll the ring instead of sleeping on it\n");
+	exit(1);
+}
+
+static void get_args(int argc, char *argv[]){
+	prog_args.name = argv[0];
+
+	int c;
+	while ((c = getopt(argc, argv, "qs")) != -1) {
+		switch (c) {
+			case 'q':
+				prog_args.quiet = 1;
+				break;
+			case 's':
+				prog_args.spin = 1;
+				break;
+			case '?':
+			default:
+				usage();
+		}
+	}
+
+	/* Get the remaining args.
+	 */
+	if (argc - optind != 1) {
+		usage();
+	}
+	prog_args.ring = argv[optind];
+}
+
+/* Read frames from a shared-memory ring published by dc -R, and print them
+ * like the pmudumper does, until dc stops.
+ */
+int main(int argc, char *argv[]){
+	get_args(argc, argv);
+
+	struct shmring_reader *reader = shmring_open(prog_args.ring);
+	if (reader == 0) {
+		perror(prog_args.ring);
+		exit(1);
+	}
+
+	unsigned long frames = 0;
+	char buf[MAX_FRAME];
+	for (;;) {
+		ssize_t size = shmring_read(reader, buf, sizeof(buf), prog_args.spin ? 0 : -1);
+		if (size < 0) {
+			if (errno != EPIPE) {
+				perror("shmring_read");
+				exit(1);
+			}
+			break;
+		}
+		if (size == 0) {
+			continue;
+		}
+
+		frames++;
+		if (!prog_args.quiet) {
+			if (size == FRAME_SIZE && c37_is_data(buf)) {
+				c37_packet pkt;
+				parse_c37_packet(&pkt, buf);
+				write_c37_packet_readable(stdout, &pkt);
+			} else {
+				printf("%zd-byte frame\n", size);
+			}
+		}
+	}
+
+	printf("%s: %lu frames, %llu lost\n", prog_args.ring, frames,
+			shmring_lost(reader));
+	shmring_close(reader);
+	return 0;
+}
@@ -0,0 +1,364 @@
+#include "c37.h"
+#include "quality.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A quality monitor watches the data frames of one stream as they go by.
+ * It takes the stream's nominal period to be a step between timestamps
+ * seen several times in a row, so that one jittered timestamp cannot
+ * change it, and a stream whose rate changes is followed either way.  It
+ * keeps a bitmap of which of the last 64 periods have had a frame, and
+ * another of which were counted missing, so that it can tell a gap from a
+ * late frame filling one, and a late frame from a duplicate, in constant
+ * memory.  Frames older than that are counted as reordered.  Until the
+ * period settles, it goes by the exact timestamps of the last few frames
+ * instead.  It also
+ * counts the frames with each STAT flag set in any of their PMU blocks.
+ *
+ * Problems go to the event log, if any, one line each:
+ *
+ *	name kind start end count
+ *
+ * where start and end are timestamps in seconds.  A gap runs from the last
+ * frame before it to the first after it.  Runs of duplicate or reordered
+ * frames, and of frames with a flag set, are reported once the run ends,
+ * from its first frame to its last.
+ */
+
+#define WINDOW	64
+
+/* Steps needed in a row to settle the period.
+ */
+#define CONFIRM	3
+
+/* Timestamps kept until the period settles.
+ */
+#define EARLY	8
+
+static const char *const flag_names[QUALITY_FLAGS] = {
+	"invalid", "error", "unsynced", "sorted", "trigger", "config",
+	"modified",
+};
+
+struct run {
+	int active;
+	uint64_t start;
+	uint64_t end;
+	unsigned long long count;
+};
+
+enum {
+	RUN_DUPLICATE = QUALITY_FLAGS,
+	RUN_REORDERED,
+	RUNS,
+};
+
+struct quality {
+	char *name;
+	FILE *events;
+	struct quality_stats *stats;
+	int started;
+	uint64_t last;
+	uint64_t seen;
+	uint64_t gapped;
+	uint64_t step;
+	int steps;
+	uint64_t early[EARLY];
+	unsigned int nearly;
+	struct run runs[RUNS];
+};
+
+static void count(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+struct quality *quality_start(const char *name, FILE *events,
+			      struct quality_stats *stats)
+{
+	struct quality *q;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+
+	q->name = strdup(name);
+	if (!q->name) {
+		free(q);
+		return NULL;
+	}
+	q->events = events;
+	q->stats = stats;
+	return q;
+}
+
+static void log_event(struct quality *q, const char *kind, uint64_t start,
+		      uint64_t end, unsigned long long n)
+{
+	if (!q->events)
+		return;
+
+	fprintf(q->events, "%s\t%s\t%llu.%06llu\t%llu.%06llu\t%llu\n",
+		q->name, kind, (unsigned long long)(start / TIME_BASE),
+		(unsigned long long)(start % TIME_BASE * 1000000 / TIME_BASE),
+		(unsigned long long)(end / TIME_BASE),
+		(unsigned long long)(end % TIME_BASE * 1000000 / TIME_BASE), n);
+}
+
+static const char *run_name(int i)
+{
+	if (i == RUN_DUPLICATE)
+		return "duplicate";
+	if (i == RUN_REORDERED)
+		return "reordered";
+	return flag_names[i];
+}
+
+/* Extends a run if on, or ends it if off.
+ */
+static void mark(struct quality *q, int i, int on, uint64_t time)
+{
+	struct run *run = &q->runs[i];
+
+	if (on) {
+		if (!run->active) {
+			run->active = 1;
+			run->start = time;
+			run->count = 0;
+		}
+		if (time > run->end || run->count == 0)
+			run->end = time;
+		run->count++;
+	} else if (run->active) {
+		log_event(q, run_name(i), run->start, run->end, run->count);
+		run->active = 0;
+	}
+}
+
+/* Returns the number of periods from a to b, to the nearest.
+ */
+static uint64_t periods(uint64_t a, uint64_t b, uint64_t period)
+{
+	return (b - a + period / 2) / period;
+}
+
+/* Returns whether a and b are the same step, give or take a quarter.
+ */
+static int same_step(uint64_t a, uint64_t b)
+{
+	return a > b ? a - b <= b / 4 : b - a <= a / 4;
+}
+
+/* Settles the period once the same step has come CONFIRM times in a row,
+ * starting the bitmaps over if it has changed.
+ */
+static uint64_t settle(struct quality *q, uint64_t step)
+{
+	struct quality_stats *stats = q->stats;
+	uint64_t period = stats->period;
+
+	if (q->steps && same_step(step, q->step)) {
+		q->steps++;
+	} else {
+		q->step = step;
+		q->steps = 1;
+	}
+
+	if (q->steps >= CONFIRM && (!period || !same_step(q->step, period))) {
+		period = q->step;
+		__atomic_store_n(&stats->period, period, __ATOMIC_RELAXED);
+		q->seen = 1;
+		q->gapped = 0;
+	}
+	return period;
+}
+
+/* Returns whether a frame has the timestamp of one of the last few, and
+ * notes its timestamp.
+ */
+static int seen_early(struct quality *q, uint64_t time)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->nearly && i < EARLY; i++)
+		if (q->early[i] == time)
+			return 1;
+	q->early[q->nearly++ % EARLY] = time;
+	return 0;
+}
+
+/* Places a frame in time.  Returns 0 if it duplicates one already seen.
+ */
+static int place(struct quality *q, uint64_t time)
+{
+	struct quality_stats *stats = q->stats;
+	uint64_t period = stats->period;
+	uint64_t bit;
+	uint64_t n;
+	int again = 0;
+
+	if (!period)
+		again = seen_early(q, time);
+
+	if (!q->started) {
+		q->started = 1;
+		q->last = time;
+		q->seen = 1;
+		return 1;
+	}
+
+	if (time > q->last) {
+		period = settle(q, time - q->last);
+		n = period ? periods(q->last, time, period) : 1;
+		if (n == 0)
+			n = 1;
+		if (n > 1) {
+			count(&stats->gaps, 1);
+			count(&stats->missing, n - 1);
+			log_event(q, "gap", q->last, time, n - 1);
+		}
+
+		/* The periods between the last frame and this one, as many
+		 * as are in the window, were counted missing.
+		 */
+		if (n >= WINDOW) {
+			q->seen = 1;
+			q->gapped = ~1ULL;
+		} else {
+			q->seen = q->seen << n | 1;
+			q->gapped = q->gapped << n |
+			    ((1ULL << (n - 1)) - 1) << 1;
+		}
+		q->last = time;
+		mark(q, RUN_DUPLICATE, 0, time);
+		mark(q, RUN_REORDERED, 0, time);
+		return 1;
+	}
+
+	/* Without a period, only a frame seen before exactly is a duplicate.
+	 */
+	n = period ? periods(time, q->last, period) : WINDOW;
+	if (again || (n < WINDOW && (q->seen & (1ULL << n)))) {
+		count(&stats->duplicate, 1);
+		mark(q, RUN_DUPLICATE, 1, time);
+		return 0;
+	}
+
+	/* A late frame takes back the missing frame counted in its place,
+	 * if one was.
+	 */
+	if (n < WINDOW) {
+		bit = 1ULL << n;
+		q->seen |= bit;
+		if ((q->gapped & bit) && stats->missing)
+			__atomic_store_n(&stats->missing, stats->missing - 1,
+					 __ATOMIC_RELAXED);
+		q->gapped &= ~bit;
+	}
+	count(&stats->reordered, 1);
+	mark(q, RUN_REORDERED, 1, time);
+	return 1;
+}
+
+/* Checks a data frame, single-PMU or combined.  Returns 0 if it duplicates
+ * a frame already seen.
+ */
+int quality_frame(struct quality *q, char *frame, size_t size)
+{
+	struct quality_stats *stats = q->stats;
+	c37_packet header;
+	uint16_t stat;
+	uint16_t flags = 0;
+	uint64_t time;
+	size_t offset;
+	int i;
+
+	if (size < HEADER_SIZE + CRC_SIZE || !c37_is_data(frame))
+		return 1;
+
+	parse_c37_header(&header, frame);
+	time = (uint64_t)header.soc * TIME_BASE + (header.fracsec & 0xFFFFFF);
+	count(&stats->frames, 1);
+
+	if (!place(q, time))
+		return 0;
+
+	for (offset = HEADER_SIZE; offset + BLOCK_SIZE + CRC_SIZE <= size;
+	     offset += BLOCK_SIZE) {
+		get_big_endian(&frame[offset], 2, (unsigned char *)&stat);
+		flags |= stat;
+	}
+
+	for (i = 0; i < QUALITY_FLAGS; i++) {
+		if (flags & (0x8000 >> i))
+			count(&stats->flagged[i], 1);
+		mark(q, i, flags & (0x8000 >> i), time);
+	}
+	return 1;
+}
+
+void quality_stop(struct quality *q)
+{
+	int i;
+
+	for (i = 0; i < RUNS; i++)
+		mark(q, i, 0, 0);
+	if (q->events)
+		fflush(q->events);
+	free(q->name);
+	free(q);
+}
+
+static unsigned long long sample(unsigned long long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void quality_add(struct quality_stats *total, struct quality_stats *stats)
+{
+	int i;
+
+	total->frames += sample(&stats->frames);
+	total->gaps += sample(&stats->gaps);
+	total->missing += sample(&stats->missing);
+	total->duplicate += sample(&stats->duplicate);
+	total->reordered += sample(&stats->reordered);
+	for (i = 0; i < QUALITY_FLAGS; i++)
+		total->flagged[i] += sample(&stats->flagged[i]);
+}
+
+int quality_problems(struct quality_stats *stats)
+{
+	int i;
+
+	if (sample(&stats->missing) || sample(&stats->duplicate) ||
+	    sample(&stats->reordered))
+		return 1;
+	for (i = 0; i < QUALITY_FLAGS; i++)
+		if (sample(&stats->flagged[i]))
+			return 1;
+	return 0;
+}
+
+void quality_report(struct quality_stats *stats, const char *name,
+		    FILE *output)
+{
+	unsigned long long period = sample(&stats->period);
+	int i;
+
+	fprintf(output, "quality %s: %llu frames", name,
+		sample(&stats->frames));
+	if (period)
+		fprintf(output, " at %.2f/s", (double)TIME_BASE / period);
+	fprintf(output, ", %llu gaps, %llu missing, %llu duplicate, "
+		"%llu reordered", sample(&stats->gaps),
+		sample(&stats->missing), sample(&stats->duplicate),
+		sample(&stats->reordered));
+	for (i = 0; i < QUALITY_FLAGS; i++)
+		if (sample(&stats->flagged[i]))
+			fprintf(output, ", %llu %s", sample(&stats->flagged[i]),
+				flag_names[i]);
+	fprintf(output, "\n");
+}
@@ -0,0 +1,35 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* STAT bits 15 down to 9, in that order.
+ */
+#define QUALITY_FLAGS	7
+
+/* Written only by the monitor's owner; others read with relaxed atomics.
+ */
+struct quality_stats {
+	unsigned long long period;
+	unsigned long long frames;
+	unsigned long long gaps;
+	unsigned long long missing;
+	unsigned long long duplicate;
+	unsigned long long reordered;
+	unsigned long long flagged[QUALITY_FLAGS];
+};
+
+struct quality;
+
+struct quality *quality_start(const char *name, FILE *events,
+			      struct quality_stats *stats);
+int quality_frame(struct quality *q, char *frame, size_t size);
+void quality_stop(struct quality *q);
+
+void quality_add(struct quality_stats *total, struct quality_stats *stats);
+int quality_problems(struct quality_stats *stats);
+void quality_report(struct quality_stats *stats, const char *name,
+		    FILE *output);
+
+#endif
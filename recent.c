@@ -0,0 +1,190 @@
+#include "recent.h"
+#include "c37.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A recent-window cache keeps the last few seconds of a stream's data
+ * frames, decoded, in a fixed ring with one array per quantity.  Only the
+ * stream's owner writes it, and it never waits for readers: each frame is
+ * written inside a sequence count that is odd while the write is under
+ * way, and readers copy what they need and start over if the count has
+ * moved meanwhile.  Copies are short, and frames come tens of milliseconds
+ * apart, so readers rarely have to retry.
+ */
+
+enum {
+	VOLTAGE_AMPLITUDE,
+	VOLTAGE_ANGLE,
+	CURRENT_AMPLITUDE,
+	CURRENT_ANGLE,
+	FREQUENCY,
+	DELTA_FREQUENCY,
+	COLUMNS,
+};
+
+struct recent {
+	char *name;
+	size_t size;
+	uint64_t *time;
+	uint16_t *stat;
+	float *columns[COLUMNS];
+
+	/* Written by the owner only.
+	 */
+	unsigned int seq __attribute__((aligned(64)));
+	unsigned long long frames;
+};
+
+struct recent *recent_start(const char *name, size_t size)
+{
+	struct recent *r;
+	int i;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->size = size;
+	r->name = strdup(name);
+	r->time = calloc(size, sizeof(*r->time));
+	r->stat = calloc(size, sizeof(*r->stat));
+	for (i = 0; i < COLUMNS; i++)
+		r->columns[i] = calloc(size, sizeof(float));
+	if (!r->name || !r->time || !r->stat) {
+		recent_stop(r);
+		return NULL;
+	}
+	for (i = 0; i < COLUMNS; i++)
+		if (!r->columns[i]) {
+			recent_stop(r);
+			return NULL;
+		}
+
+	return r;
+}
+
+/* Caches single-PMU data frames; anything else is left out.
+ */
+void recent_frame(struct recent *r, char *frame, size_t size)
+{
+	unsigned long long frac;
+	c37_packet pkt;
+	size_t i;
+
+	if (size != FRAME_SIZE || !c37_is_data(frame))
+		return;
+
+	parse_c37_packet(&pkt, frame);
+	frac = pkt.fracsec & 0xFFFFFF;
+	i = r->frames % r->size;
+
+	__atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	r->time[i] = (uint64_t)pkt.soc * 1000000 + frac * 1000000 / TIME_BASE;
+	r->stat[i] = pkt.stat;
+	r->columns[VOLTAGE_AMPLITUDE][i] = pkt.voltage_amplitude;
+	r->columns[VOLTAGE_ANGLE][i] = pkt.voltage_angle;
+	r->columns[CURRENT_AMPLITUDE][i] = pkt.current_amplitude;
+	r->columns[CURRENT_ANGLE][i] = pkt.current_angle;
+	r->columns[FREQUENCY][i] = pkt.voltage_frequency;
+	r->columns[DELTA_FREQUENCY][i] = pkt.delta_frequency;
+	__atomic_store_n(&r->frames, r->frames + 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies the frames no more than span microseconds older than the newest,
+ * or all of them if span is 0, oldest first, and at most size of the
+ * newest.  Returns the number of frames copied.
+ */
+static size_t copy_frames(struct recent *r, struct recent_frame *frames,
+			  size_t size, uint64_t span,
+			  unsigned long long total)
+{
+	struct recent_frame *f;
+	uint64_t newest;
+	size_t first;
+	size_t count;
+	size_t n;
+	size_t i;
+	size_t j;
+
+	count = total < r->size ? total : r->size;
+	if (count > size)
+		count = size;
+	if (!count)
+		return 0;
+
+	newest = r->time[(total - 1) % r->size];
+	for (n = 0; n < count; n++) {
+		i = (total - 1 - n) % r->size;
+		if (span && r->time[i] + span < newest)
+			break;
+	}
+
+	first = total - n;
+	for (i = 0; i < n; i++) {
+		j = (first + i) % r->size;
+		f = &frames[i];
+		f->time = r->time[j];
+		f->stat = r->stat[j];
+		f->voltage_amplitude = r->columns[VOLTAGE_AMPLITUDE][j];
+		f->voltage_angle = r->columns[VOLTAGE_ANGLE][j];
+		f->current_amplitude = r->columns[CURRENT_AMPLITUDE][j];
+		f->current_angle = r->columns[CURRENT_ANGLE][j];
+		f->frequency = r->columns[FREQUENCY][j];
+		f->delta_frequency = r->columns[DELTA_FREQUENCY][j];
+	}
+	return n;
+}
+
+/* Takes a consistent copy of the recent frames from any thread, without
+ * holding up the owner.
+ */
+size_t recent_snapshot(struct recent *r, struct recent_frame *frames,
+		       size_t size, uint64_t span)
+{
+	unsigned long long total;
+	unsigned int seq;
+	size_t n;
+
+	for (;;) {
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		total = __atomic_load_n(&r->frames, __ATOMIC_RELAXED);
+		n = copy_frames(r, frames, size, span, total);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq)
+			return n;
+	}
+}
+
+const char *recent_name(struct recent *r)
+{
+	return r->name;
+}
+
+size_t recent_size(struct recent *r)
+{
+	return r->size;
+}
+
+void recent_stop(struct recent *r)
+{
+	int i;
+
+	free(r->name);
+	free(r->time);
+	free(r->stat);
+	for (i = 0; i < COLUMNS; i++)
+		free(r->columns[i]);
+	free(r);
+}
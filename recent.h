@@ -0,0 +1,31 @@
+#ifndef RECENT_H
+#define RECENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* One decoded frame, as read back from a cache.  Times are in
+ * microseconds.
+ */
+struct recent_frame {
+	uint64_t time;
+	uint16_t stat;
+	float voltage_amplitude;
+	float voltage_angle;
+	float current_amplitude;
+	float current_angle;
+	float frequency;
+	float delta_frequency;
+};
+
+struct recent;
+
+struct recent *recent_start(const char *name, size_t size);
+void recent_frame(struct recent *r, char *frame, size_t size);
+size_t recent_snapshot(struct recent *r, struct recent_frame *frames,
+		       size_t size, uint64_t span);
+const char *recent_name(struct recent *r);
+size_t recent_size(struct recent *r);
+void recent_stop(struct recent *r);
+
+#endif
@@ -0,0 +1,377 @@
+#include "c37.h"
+#include "decimate.h"
+#include "flight.h"
+#include "shed.h"
+
+#include <errno.h>
+#include <linux/sockios.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+/* A shedder stands between a stream and a slow sink.  It watches how much
+ * the kernel has queued for the sink, and once that passes the limit it
+ * stops feeding the socket and sheds load instead, by one of three
+ * policies:
+ *
+ *	drop	hold frames back, dropping the oldest whole frames to make room
+ *	divert	write frames to a divert log instead of the sink
+ *	nth:N, rate:R or avg:R
+ *		hold back a decimated stream, dropping the oldest if need be
+ *
+ * Frames held back go out, oldest first, as soon as the queue falls below
+ * the limit, and shedding ends once it falls below half the limit with
+ * nothing held back.  The socket is never written in a way that blocks;
+ * a frame the kernel takes only part of is finished before anything else.
+ */
+
+#define BACKLOG_MIN	4096
+#define BACKLOG_MAX	65536
+
+enum {
+	SHED_DROP,
+	SHED_DIVERT,
+	SHED_DECIMATE,
+};
+
+struct shedder {
+	int policy;
+	size_t limit;
+	struct decimator *decimator;
+	struct log *divert;
+	struct shed_stats *stats;
+
+	/* Held-back data starts with what is left of a frame partly sent,
+	 * followed by whole frames.
+	 */
+	char *backlog;
+	size_t capacity;
+	size_t start;
+	size_t length;
+	size_t partial;
+};
+
+static void count(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+int shed_policy_valid(const char *policy)
+{
+	struct decimator *dec;
+
+	if (!strcmp(policy, "drop") || !strcmp(policy, "divert"))
+		return 1;
+
+	dec = decimator_start(policy);
+	if (!dec)
+		return 0;
+	decimator_stop(dec);
+	return 1;
+}
+
+/* The divert log is needed only for the divert policy, and is the
+ * shedder's from then on.
+ */
+struct shedder *shedder_start(const char *policy, size_t limit,
+			      struct log *divert, struct shed_stats *stats)
+{
+	struct shedder *sh;
+
+	sh = calloc(1, sizeof(*sh));
+	if (!sh)
+		return NULL;
+
+	sh->limit = limit;
+	sh->stats = stats;
+	sh->capacity = limit < BACKLOG_MIN ? BACKLOG_MIN :
+	    limit > BACKLOG_MAX ? BACKLOG_MAX : limit;
+
+	if (!strcmp(policy, "drop")) {
+		sh->policy = SHED_DROP;
+	} else if (!strcmp(policy, "divert")) {
+		sh->policy = SHED_DIVERT;
+		sh->divert = divert;
+	} else {
+		sh->policy = SHED_DECIMATE;
+		sh->decimator = decimator_start(policy);
+		if (!sh->decimator) {
+			free(sh);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	if (sh->policy == SHED_DIVERT && !divert) {
+		free(sh);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return sh;
+}
+
+static size_t queued(int sock)
+{
+	int n;
+
+	if (ioctl(sock, SIOCOUTQ, &n) < 0 || n < 0)
+		return 0;
+	return n;
+}
+
+static void release(struct shedder *sh, struct bufcache *cache)
+{
+	bufcache_put(cache, sh->backlog);
+	sh->backlog = NULL;
+	sh->start = 0;
+	sh->length = 0;
+	sh->partial = 0;
+}
+
+static int reserve(struct shedder *sh, struct bufcache *cache, size_t size)
+{
+	if (!sh->backlog) {
+		sh->backlog = bufcache_get(cache, sh->capacity);
+		if (!sh->backlog)
+			return -1;
+	}
+
+	if (sh->start + sh->length + size > sh->capacity) {
+		memmove(sh->backlog, &sh->backlog[sh->start], sh->length);
+		sh->start = 0;
+	}
+	return 0;
+}
+
+/* Drops the oldest whole frame held back.  Returns 0 if there is none.
+ */
+static int drop_oldest(struct shedder *sh)
+{
+	char *frame = &sh->backlog[sh->start + sh->partial];
+	size_t whole = sh->length - sh->partial;
+	int size;
+
+	if (!whole)
+		return 0;
+
+	size = c37_frame_size(frame, whole);
+	if (size <= 0 || (size_t)size > whole)
+		size = whole;
+	memmove(frame, &frame[size], whole - size);
+	sh->length -= size;
+	count(&sh->stats->dropped, 1);
+	return 1;
+}
+
+/* Holds back a whole frame, making room for it if need be.
+ */
+static int hold(struct shedder *sh, struct bufcache *cache, char *frame,
+		size_t size)
+{
+	size_t room;
+
+	room = sh->capacity - sh->partial;
+	if (room > sh->limit)
+		room = sh->limit;
+	if (size > room) {
+		count(&sh->stats->dropped, 1);
+		return 0;
+	}
+
+	if (reserve(sh, cache, size) < 0)
+		return -1;
+	while (sh->length - sh->partial + size > room && drop_oldest(sh))
+		;
+
+	memcpy(&sh->backlog[sh->start + sh->length], frame, size);
+	sh->length += size;
+	count(&sh->stats->deferred, 1);
+	return 0;
+}
+
+/* Sends what the socket takes now.  Returns the number of bytes sent.
+ */
+static ssize_t send_some(int sock, char *data, size_t size)
+{
+	uint64_t since = flight_clock();
+	ssize_t ns;
+
+	ns = send(sock, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+	flight_record((size_t)ns < size ? FLIGHT_SHORT_SEND : FLIGHT_SEND,
+		      sock, ns < 0 ? -errno : ns, since);
+	if (ns < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		       errno == EINTR))
+		return 0;
+	return ns;
+}
+
+/* Returns how much is left, from offset n, of a frame cut short there;
+ * 0 if a frame starts at n.
+ */
+static size_t cut_short(char *data, size_t size, size_t n)
+{
+	size_t offset = 0;
+	int framesize;
+
+	while (offset < n) {
+		framesize = c37_frame_size(&data[offset], size - offset);
+		if (framesize <= 0 || (size_t)framesize > size - offset)
+			return size - n;
+		offset += framesize;
+	}
+	return offset - n;
+}
+
+static int flush(struct shedder *sh, struct bufcache *cache, int sock)
+{
+	char *data = &sh->backlog[sh->start];
+	ssize_t ns;
+	size_t n;
+
+	ns = send_some(sock, data, sh->length);
+	if (ns < 0)
+		return -1;
+	n = ns;
+
+	if (n >= sh->length) {
+		release(sh, cache);
+		return 0;
+	}
+
+	if (n >= sh->partial)
+		sh->partial = cut_short(&data[sh->partial], sh->length -
+					sh->partial, n - sh->partial);
+	else
+		sh->partial -= n;
+	sh->start += n;
+	sh->length -= n;
+	return 0;
+}
+
+static int shed(struct shedder *sh, struct bufcache *cache, char *data,
+		size_t size)
+{
+	size_t n;
+	size_t outsize;
+	char *out;
+	int framesize;
+
+	for (n = 0; n < size; n += framesize) {
+		framesize = c37_frame_size(&data[n], size - n);
+		if (framesize <= 0 || (size_t)framesize > size - n)
+			break;
+
+		switch (sh->policy) {
+		case SHED_DROP:
+			if (hold(sh, cache, &data[n], framesize) < 0)
+				return -1;
+			break;
+
+		case SHED_DIVERT:
+			if (log_write(sh->divert, &data[n], framesize) <
+			    (size_t)framesize)
+				return -1;
+			count(&sh->stats->diverted, 1);
+			break;
+
+		case SHED_DECIMATE:
+			outsize = decimator_push(sh->decimator, &data[n],
+						 framesize, &out);
+			if (!outsize)
+				count(&sh->stats->thinned, 1);
+			else if (hold(sh, cache, out, outsize) < 0)
+				return -1;
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Starts an episode of shedding, unless one is under way.
+ */
+static void start_shedding(struct shed_stats *stats)
+{
+	if (stats->shedding)
+		return;
+	__atomic_store_n(&stats->shedding, 1, __ATOMIC_RELAXED);
+	count(&stats->episodes, 1);
+}
+
+/* Sends frames while the sink keeps up, holding back whatever the socket
+ * does not take, which starts shedding.
+ */
+static int send_now(struct shedder *sh, struct bufcache *cache, int sock,
+		    char *data, size_t size)
+{
+	ssize_t ns;
+	size_t n;
+	size_t rest;
+
+	ns = send_some(sock, data, size);
+	if (ns < 0)
+		return -1;
+	n = ns;
+	if (n == size)
+		return 0;
+
+	start_shedding(sh->stats);
+	rest = cut_short(data, size, n);
+	if (rest >= sh->capacity) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (rest) {
+		if (reserve(sh, cache, rest) < 0)
+			return -1;
+		memcpy(&sh->backlog[sh->start], &data[n], rest);
+		sh->length = rest;
+		sh->partial = rest;
+	}
+
+	return shed(sh, cache, &data[n + rest], size - n - rest);
+}
+
+/* Sends whole frames to the sink, or sheds them.  Returns -1 only if the
+ * sink has failed.
+ */
+int shedder_send(struct shedder *sh, struct bufcache *cache, int sock,
+		 char *data, size_t size)
+{
+	struct shed_stats *stats = sh->stats;
+	size_t depth = queued(sock);
+
+	if (depth > stats->maxqueue)
+		__atomic_store_n(&stats->maxqueue, depth, __ATOMIC_RELAXED);
+
+	if (sh->length && depth < sh->limit) {
+		if (flush(sh, cache, sock) < 0)
+			return -1;
+		depth = queued(sock);
+	}
+
+	if (sh->length || depth >= sh->limit)
+		start_shedding(stats);
+	else if (stats->shedding && depth < sh->limit / 2)
+		__atomic_store_n(&stats->shedding, 0, __ATOMIC_RELAXED);
+
+	if (!stats->shedding)
+		return send_now(sh, cache, sock, data, size);
+	return shed(sh, cache, data, size);
+}
+
+/* Whole frames still held back are counted as dropped.
+ */
+void shedder_stop(struct shedder *sh, struct bufcache *cache)
+{
+	while (sh->backlog && drop_oldest(sh))
+		;
+	release(sh, cache);
+	if (sh->decimator)
+		decimator_stop(sh->decimator);
+	if (sh->divert)
+		log_stop(sh->divert);
+	__atomic_store_n(&sh->stats->shedding, 0, __ATOMIC_RELAXED);
+	free(sh);
+}
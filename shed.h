@@ -0,0 +1,30 @@
+#ifndef SHED_H
+#define SHED_H
+
+#include "bufpool.h"
+#include "log.h"
+
+#include <stddef.h>
+
+/* Written only by the shedder's owner; others read with relaxed atomics.
+ */
+struct shed_stats {
+	int shedding;
+	unsigned long long episodes;
+	unsigned long long dropped;
+	unsigned long long thinned;
+	unsigned long long diverted;
+	unsigned long long deferred;
+	unsigned long long maxqueue;
+};
+
+struct shedder;
+
+int shed_policy_valid(const char *policy);
+struct shedder *shedder_start(const char *policy, size_t limit,
+			      struct log *divert, struct shed_stats *stats);
+int shedder_send(struct shedder *sh, struct bufcache *cache, int sock,
+		 char *data, size_t size);
+void shedder_stop(struct shedder *sh, struct bufcache *cache);
+
+#endif
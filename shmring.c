@@ -0,0 +1,509 @@
+#include "shmring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A shared-memory ring carries frames from dc to readers on the same host
+ * without a socket in between.  It lives in a POSIX shared memory object:
+ * a header, then a data area of records, each a small header followed by
+ * one frame, padded to 16 bytes.  A record that would run past the end of
+ * the data area is replaced by a wrap record, and goes at the start.
+ *
+ * Positions in the ring count bytes ever written, so never repeat.  There
+ * is one producer, which never waits for readers: before overwriting the
+ * oldest records it moves the tail past them.  A reader copies a record
+ * out, then checks the tail again; if the tail has passed the record, the
+ * copy may be torn, and the reader starts over from the tail.  Records
+ * carry sequence numbers, so that readers can count the frames they lost.
+ *
+ * Readers that would rather sleep than poll say so on a page of their own,
+ * and the producer wakes them with a futex after each frame.
+ *
+ * Readers map everything else read-only, and the producer never trusts
+ * what is in shared memory: it keeps its own head and tail, and the length
+ * of every record between them, and only ever stores to the shared copies,
+ * so that no reader can lead it astray.  The object is open to dc's own
+ * user only.
+ */
+
+#define SHMRING_MAGIC	0x504d5552
+#define SHMRING_VERSION	2
+#define SHMRING_ALIGN	16
+#define SHMRING_WRAP	1
+#define SHMRING_MODE	0600
+
+/* Readers that cannot write the readers' page poll this often.
+ */
+#define SHMRING_POLL_MS	1
+
+/* The first page, written by the producer.
+ */
+struct shmring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t page;
+	uint32_t closed;
+	char pad0[36];
+
+	uint64_t head;
+	uint64_t tail;
+	uint32_t futex;
+	char pad1[44];
+};
+
+/* The second page, written by readers.
+ */
+struct shmring_readers {
+	uint32_t waiters;
+};
+
+struct shmring_record {
+	uint32_t size;
+	uint32_t flags;
+	uint64_t seq;
+};
+
+struct shmring {
+	char *name;
+	struct shmring_header *header;
+	struct shmring_readers *readers;
+	char *data;
+	size_t size;
+	size_t length;
+	uint64_t seq;
+
+	/* The producer's own head and tail, and the length of each record
+	 * between them, oldest at first.
+	 */
+	uint64_t head;
+	uint64_t tail;
+	uint32_t *lengths;
+	size_t nlengths;
+	size_t first;
+	size_t count;
+
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned long long overwritten;
+};
+
+struct shmring_reader {
+	struct shmring_header *header;
+	struct shmring_readers *readers;
+	char *data;
+	size_t size;
+	size_t length;
+	uint64_t position;
+	uint64_t seq;
+	unsigned long long lost;
+};
+
+static size_t record_length(size_t size)
+{
+	size += sizeof(struct shmring_record);
+	return (size + SHMRING_ALIGN - 1) & ~(size_t)(SHMRING_ALIGN - 1);
+}
+
+static int futex(uint32_t *word, int op, uint32_t value,
+		 const struct timespec *timeout)
+{
+	return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/* Shared memory object names start with a slash; add one if need be.
+ */
+static char *object_name(const char *name)
+{
+	char *s;
+
+	s = malloc(strlen(name) + 2);
+	if (!s)
+		return NULL;
+	s[0] = '/';
+	strcpy(&s[name[0] == '/' ? 0 : 1], name);
+	return s;
+}
+
+/* Any ring left over by an earlier producer is unlinked rather than
+ * reused, so that its readers see it close instead of seeing it change
+ * under them.
+ */
+struct shmring *shmring_start(const char *name, size_t size)
+{
+	struct shmring *ring;
+	size_t page = sysconf(_SC_PAGESIZE);
+	void *map;
+	int err;
+	int fd;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	size &= ~(size_t)(SHMRING_ALIGN - 1);
+	ring->name = object_name(name);
+	ring->nlengths = size / SHMRING_ALIGN;
+	ring->lengths = calloc(ring->nlengths, sizeof(*ring->lengths));
+	if (!ring->name || !ring->lengths)
+		goto fail;
+
+	ring->length = 2 * page + size;
+	shm_unlink(ring->name);
+	fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, SHMRING_MODE);
+	if (fd < 0)
+		goto fail;
+	if (ftruncate(fd, ring->length) < 0) {
+		err = errno;
+		close(fd);
+		shm_unlink(ring->name);
+		errno = err;
+		goto fail;
+	}
+	map = mmap(NULL, ring->length, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		shm_unlink(ring->name);
+		errno = err;
+		goto fail;
+	}
+
+	ring->header = map;
+	ring->readers = (struct shmring_readers *)((char *)map + page);
+	ring->data = (char *)map + 2 * page;
+	ring->size = size;
+	ring->header->size = size;
+	ring->header->page = page;
+	ring->header->version = SHMRING_VERSION;
+	__atomic_store_n(&ring->header->magic, SHMRING_MAGIC,
+			 __ATOMIC_RELEASE);
+	return ring;
+
+fail:
+	free(ring->lengths);
+	free(ring->name);
+	free(ring);
+	return NULL;
+}
+
+/* Notes a record, or the space skipped by a wrap record, written at the
+ * head.
+ */
+static void push_length(struct shmring *ring, size_t length, int wrap)
+{
+	ring->lengths[(ring->first + ring->count++) % ring->nlengths] =
+	    length | (wrap ? 1 : 0);
+	ring->head += length;
+}
+
+/* Moves the tail past the oldest records until there are bytes to spare
+ * at the head.
+ */
+static void make_room(struct shmring *ring, size_t bytes)
+{
+	uint64_t moved = ring->tail;
+	uint32_t length;
+
+	while (ring->head + bytes - ring->tail > ring->size) {
+		length = ring->lengths[ring->first];
+		ring->first = (ring->first + 1) % ring->nlengths;
+		ring->count--;
+		ring->tail += length & ~1u;
+		if (!(length & 1))
+			ring->overwritten++;
+	}
+
+	if (ring->tail != moved) {
+		__atomic_store_n(&ring->header->tail, ring->tail,
+				 __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+}
+
+static void wake(struct shmring *ring)
+{
+	struct shmring_header *header = ring->header;
+
+	if (!__atomic_load_n(&ring->readers->waiters, __ATOMIC_SEQ_CST))
+		return;
+	__atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+	futex(&header->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+int shmring_publish(struct shmring *ring, char *frame, size_t size)
+{
+	struct shmring_record *record;
+	size_t length = record_length(size);
+	size_t offset;
+
+	if (length > ring->size / 2) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	offset = ring->head % ring->size;
+	if (offset + length > ring->size) {
+		make_room(ring, ring->size - offset);
+		record = (struct shmring_record *)&ring->data[offset];
+		record->flags = SHMRING_WRAP;
+		push_length(ring, ring->size - offset, 1);
+		offset = 0;
+	}
+
+	make_room(ring, length);
+	record = (struct shmring_record *)&ring->data[offset];
+	record->size = size;
+	record->flags = 0;
+	record->seq = ring->seq++;
+	memcpy(&record[1], frame, size);
+	push_length(ring, length, 0);
+
+	__atomic_store_n(&ring->header->head, ring->head, __ATOMIC_SEQ_CST);
+	wake(ring);
+
+	ring->frames++;
+	ring->bytes += size;
+	return 0;
+}
+
+void shmring_report(struct shmring *ring, FILE *output)
+{
+	fprintf(output, "ring %s: %llu frames, %llu bytes, %llu overwritten\n",
+		ring->name, ring->frames, ring->bytes, ring->overwritten);
+}
+
+void shmring_stop(struct shmring *ring)
+{
+	__atomic_store_n(&ring->header->closed, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&ring->header->futex, 1, __ATOMIC_SEQ_CST);
+	futex(&ring->header->futex, FUTEX_WAKE, INT_MAX, NULL);
+
+	munmap(ring->header, ring->length);
+	shm_unlink(ring->name);
+	free(ring->lengths);
+	free(ring->name);
+	free(ring);
+}
+
+/* Walks from the tail to the head, so as to learn the sequence number of
+ * the next frame to be published.
+ */
+static void catch_up(struct shmring_reader *reader)
+{
+	struct shmring_header *header = reader->header;
+	struct shmring_record record;
+	uint64_t head;
+	uint64_t tail;
+	size_t offset;
+
+restart:
+	reader->position = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	reader->seq = 0;
+
+	while (reader->position < head) {
+		offset = reader->position % reader->size;
+		memcpy(&record, &reader->data[offset], sizeof(record));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+		if (reader->position < tail)
+			goto restart;
+
+		if (record.flags & SHMRING_WRAP) {
+			reader->position += reader->size - offset;
+		} else {
+			reader->position += record_length(record.size);
+			reader->seq = record.seq + 1;
+		}
+	}
+}
+
+/* Readers start with the next frame published.
+ */
+struct shmring_reader *shmring_open(const char *name)
+{
+	struct shmring_reader *reader;
+	struct shmring_header header;
+	char *object;
+	void *map;
+	int writable = 1;
+	int err;
+	int fd;
+
+	reader = calloc(1, sizeof(*reader));
+	object = object_name(name);
+	if (!reader || !object) {
+		free(reader);
+		free(object);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* A reader that may not write the ring can still follow it, by
+	 * polling.
+	 */
+	fd = shm_open(object, O_RDWR, 0);
+	if (fd < 0 && errno == EACCES) {
+		fd = shm_open(object, O_RDONLY, 0);
+		writable = 0;
+	}
+	err = errno;
+	free(object);
+	if (fd < 0)
+		goto fail;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    header.magic != SHMRING_MAGIC ||
+	    header.version != SHMRING_VERSION ||
+	    header.page != (uint64_t)sysconf(_SC_PAGESIZE)) {
+		close(fd);
+		err = EPROTO;
+		goto fail;
+	}
+
+	reader->size = header.size;
+	reader->length = 2 * header.page + reader->size;
+	map = mmap(NULL, reader->length, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	if (map != MAP_FAILED && writable) {
+		reader->readers = mmap((char *)map + header.page, header.page,
+				       PROT_READ | PROT_WRITE,
+				       MAP_SHARED | MAP_FIXED, fd, header.page);
+		err = errno;
+		if (reader->readers == MAP_FAILED) {
+			munmap(map, reader->length);
+			map = MAP_FAILED;
+		}
+	}
+	close(fd);
+	if (map == MAP_FAILED)
+		goto fail;
+
+	reader->header = map;
+	if (!writable)
+		reader->readers = NULL;
+	reader->data = (char *)map + 2 * header.page;
+	catch_up(reader);
+	return reader;
+
+fail:
+	free(reader);
+	errno = err;
+	return NULL;
+}
+
+/* Sleeps until the head moves, the ring closes, or the timeout passes.
+ * A reader that cannot ask to be woken wakes itself to poll.
+ */
+static void wait_for(struct shmring_reader *reader, int timeout)
+{
+	struct shmring_header *header = reader->header;
+	struct timespec ts;
+	uint32_t value;
+
+	if (!reader->readers && (timeout < 0 || timeout > SHMRING_POLL_MS))
+		timeout = SHMRING_POLL_MS;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = timeout % 1000 * 1000000L;
+
+	if (reader->readers)
+		__atomic_add_fetch(&reader->readers->waiters, 1,
+				   __ATOMIC_SEQ_CST);
+	value = __atomic_load_n(&header->futex, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) ==
+	    reader->position && !__atomic_load_n(&header->closed,
+						  __ATOMIC_SEQ_CST))
+		futex(&header->futex, FUTEX_WAIT, value,
+		      timeout < 0 ? NULL : &ts);
+	if (reader->readers)
+		__atomic_sub_fetch(&reader->readers->waiters, 1,
+				   __ATOMIC_SEQ_CST);
+}
+
+/* Copies out the next frame, waiting up to timeout milliseconds for one,
+ * or forever if timeout is negative.  Returns the size of the frame, which
+ * is cut short if the buffer is too small; 0 if there is none yet; or -1
+ * with errno EPIPE once the producer has stopped and every frame has been
+ * read.
+ */
+ssize_t shmring_read(struct shmring_reader *reader, char *buffer, size_t size,
+		     int timeout)
+{
+	struct shmring_header *header = reader->header;
+	struct shmring_record record;
+	uint64_t head;
+	uint64_t tail;
+	size_t offset;
+	int waited = 0;
+
+	for (;;) {
+		head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		if (reader->position == head) {
+			if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) &&
+			    head == __atomic_load_n(&header->head,
+						    __ATOMIC_ACQUIRE)) {
+				errno = EPIPE;
+				return -1;
+			}
+			if (!timeout || waited)
+				return 0;
+			wait_for(reader, timeout);
+			waited = 1;
+			continue;
+		}
+
+		tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+		if (reader->position < tail)
+			reader->position = tail;
+
+		offset = reader->position % reader->size;
+		memcpy(&record, &reader->data[offset], sizeof(record));
+		if (!(record.flags & SHMRING_WRAP)) {
+			if (record.size > reader->size - offset -
+			    sizeof(record))
+				record.size = 0;
+			memcpy(buffer, &reader->data[offset + sizeof(record)],
+			       record.size < size ? record.size : size);
+		}
+
+		/* The producer may have overwritten the record meanwhile.
+		 */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+		if (reader->position < tail)
+			continue;
+
+		if (record.flags & SHMRING_WRAP) {
+			reader->position += reader->size - offset;
+			continue;
+		}
+		reader->position += record_length(record.size);
+
+		if (record.seq > reader->seq)
+			reader->lost += record.seq - reader->seq;
+		reader->seq = record.seq + 1;
+		return record.size;
+	}
+}
+
+unsigned long long shmring_lost(struct shmring_reader *reader)
+{
+	return reader->lost;
+}
+
+void shmring_close(struct shmring_reader *reader)
+{
+	munmap(reader->header, reader->length);
+	free(reader);
+}
@@ -0,0 +1,26 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* The producer's side, used by dc.
+ */
+struct shmring;
+
+struct shmring *shmring_start(const char *name, size_t size);
+int shmring_publish(struct shmring *ring, char *frame, size_t size);
+void shmring_report(struct shmring *ring, FILE *output);
+void shmring_stop(struct shmring *ring);
+
+/* The consumer's side, for any number of readers on the same host.
+ */
+struct shmring_reader;
+
+struct shmring_reader *shmring_open(const char *name);
+ssize_t shmring_read(struct shmring_reader *reader, char *buffer, size_t size,
+		     int timeout);
+unsigned long long shmring_lost(struct shmring_reader *reader);
+void shmring_close(struct shmring_reader *reader);
+
+#endif
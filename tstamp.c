@@ -0,0 +1,298 @@
+#include "tstamp.h"
+#include "latency.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* Kernel timestamps split the time data spends inside dc's host into its
+ * parts.  The kernel stamps each segment from the source as it arrives,
+ * and each send to the sink as it enters the queueing discipline and as
+ * it is handed to the device, and hands the send timestamps back on the
+ * sink socket's error queue, keyed by the offset in the stream of the last
+ * byte sent.  Each send is matched to the read it came from by that
+ * offset, which gives, per chunk of data:
+ *
+ *	kernel, receiving	arrival to the return of the read
+ *	in dc			the return of the read to the send
+ *	kernel, queueing	the send to the queueing discipline
+ *	kernel, sending		the send to the device
+ *	total			arrival to the device
+ *
+ * Software timestamps are on the real-time clock, so times in dc are taken
+ * on that clock too.
+ */
+
+#define PENDING		4096
+#define DRAIN_MS	100
+
+#ifndef SCM_TIMESTAMPING
+#define SCM_TIMESTAMPING	SO_TIMESTAMPING
+#endif
+
+enum {
+	KERNEL_RECEIVING,
+	IN_DC,
+	KERNEL_QUEUEING,
+	KERNEL_SENDING,
+	TOTAL,
+	SPANS,
+};
+
+static const char *const span_names[SPANS] = {
+	"kernel, receiving", "in dc", "kernel, queueing", "kernel, sending",
+	"total",
+};
+
+/* A send awaiting its timestamps.
+ */
+struct pending {
+	uint32_t last;
+	struct timespec arrived;
+	struct timespec sent;
+};
+
+struct tstamp {
+	int pullsock;
+	int pushsock;
+	struct latency *spans[SPANS];
+
+	/* The read whose data is being sent.
+	 */
+	struct timespec arrived;
+	struct timespec received;
+
+	/* Sends from first up to next are awaiting timestamps.
+	 */
+	uint32_t offset;
+	struct pending pending[PENDING];
+	unsigned long first;
+	unsigned long next;
+	unsigned long long unmatched;
+};
+
+struct tstamp *tstamp_start(int pullsock, int pushsock)
+{
+	int rx = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	int tx = SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE |
+		 SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+		 SOF_TIMESTAMPING_OPT_TSONLY;
+	struct tstamp *t;
+	int err;
+	int i;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	for (i = 0; i < SPANS; i++) {
+		t->spans[i] = latency_start();
+		if (!t->spans[i]) {
+			tstamp_stop(t);
+			return NULL;
+		}
+	}
+
+	if (setsockopt(pullsock, SOL_SOCKET, SO_TIMESTAMPING, &rx,
+		       sizeof(rx)) < 0 ||
+	    setsockopt(pushsock, SOL_SOCKET, SO_TIMESTAMPING, &tx,
+		       sizeof(tx)) < 0) {
+		err = errno;
+		tstamp_stop(t);
+		errno = err;
+		return NULL;
+	}
+
+	t->pullsock = pullsock;
+	t->pushsock = pushsock;
+	return t;
+}
+
+static int stamped(const struct timespec *ts)
+{
+	return ts->tv_sec || ts->tv_nsec;
+}
+
+/* Reads like recv(), noting when the data arrived and when it was read.
+ */
+ssize_t tstamp_recv(struct tstamp *t, char *buffer, size_t size)
+{
+	char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct scm_timestamping *ts;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t n;
+
+	iov.iov_base = buffer;
+	iov.iov_len = size;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	n = recvmsg(t->pullsock, &msg, 0);
+	if (n <= 0)
+		return n;
+
+	clock_gettime(CLOCK_REALTIME, &t->received);
+	memset(&t->arrived, 0, sizeof(t->arrived));
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			ts = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			t->arrived = ts->ts[0];
+		}
+
+	if (stamped(&t->arrived))
+		latency_span(t->spans[KERNEL_RECEIVING], &t->arrived,
+			     &t->received);
+	return n;
+}
+
+/* Matches a timestamp to its send.  Sends whose timestamps never came are
+ * given up on.
+ */
+static void match(struct tstamp *t, uint32_t id, int type,
+		  const struct timespec *when)
+{
+	struct pending *p;
+
+	while (t->first != t->next) {
+		p = &t->pending[t->first % PENDING];
+		if ((int32_t)(id - p->last) < 0)
+			return;
+		if (id == p->last)
+			break;
+		t->first++;
+		t->unmatched++;
+	}
+	if (t->first == t->next)
+		return;
+
+	if (type == SCM_TSTAMP_SCHED) {
+		latency_span(t->spans[KERNEL_QUEUEING], &p->sent, when);
+	} else if (type == SCM_TSTAMP_SND) {
+		latency_span(t->spans[KERNEL_SENDING], &p->sent, when);
+		if (stamped(&p->arrived))
+			latency_span(t->spans[TOTAL], &p->arrived, when);
+		t->first++;
+	}
+}
+
+/* Collects whatever timestamps the kernel has handed back, waiting up to
+ * timeout milliseconds for the first.
+ */
+static void collect(struct tstamp *t, int timeout)
+{
+	char control[512];
+	struct sock_extended_err *err;
+	struct scm_timestamping *ts;
+	struct cmsghdr *cmsg;
+	struct pollfd fd;
+	struct msghdr msg;
+	int flags = MSG_ERRQUEUE | MSG_DONTWAIT;
+
+	fd.fd = t->pushsock;
+	fd.events = 0;
+	if (timeout && poll(&fd, 1, timeout) <= 0)
+		return;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(t->pushsock, &msg, flags) < 0)
+			return;
+
+		ts = NULL;
+		err = NULL;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SCM_TIMESTAMPING)
+				ts = (void *)CMSG_DATA(cmsg);
+			else if ((cmsg->cmsg_level == SOL_IP &&
+				  cmsg->cmsg_type == IP_RECVERR) ||
+				 (cmsg->cmsg_level == SOL_IPV6 &&
+				  cmsg->cmsg_type == IPV6_RECVERR))
+				err = (void *)CMSG_DATA(cmsg);
+		}
+
+		if (ts && err && err->ee_errno == ENOMSG &&
+		    err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+			match(t, err->ee_data, err->ee_info, &ts->ts[0]);
+	}
+}
+
+/* Sends like send(), remembering the send until its timestamps come back.
+ */
+ssize_t tstamp_send(struct tstamp *t, char *data, size_t size)
+{
+	struct timespec sent;
+	struct pending *p;
+	ssize_t n;
+
+	clock_gettime(CLOCK_REALTIME, &sent);
+	n = send(t->pushsock, data, size, 0);
+	if (n <= 0)
+		return n;
+	latency_span(t->spans[IN_DC], &t->received, &sent);
+
+	if (t->next - t->first == PENDING) {
+		t->first++;
+		t->unmatched++;
+	}
+	t->offset += n;
+	p = &t->pending[t->next++ % PENDING];
+	p->last = t->offset - 1;
+	p->arrived = t->arrived;
+	p->sent = sent;
+
+	collect(t, 0);
+	return n;
+}
+
+/* Waits briefly for the timestamps of the last sends.
+ */
+static void drain(struct tstamp *t)
+{
+	int waited;
+
+	for (waited = 0; t->first != t->next && waited < DRAIN_MS;
+	     waited += DRAIN_MS / 10)
+		collect(t, DRAIN_MS / 10);
+}
+
+void tstamp_report(struct tstamp *t, FILE *output)
+{
+	char name[64];
+	int i;
+
+	drain(t);
+
+	for (i = 0; i < SPANS; i++) {
+		snprintf(name, sizeof(name), "residence %s", span_names[i]);
+		latency_report(t->spans[i], name, output);
+	}
+	fprintf(output, "residence: %llu sends without timestamps\n",
+		t->unmatched + (t->next - t->first));
+}
+
+void tstamp_stop(struct tstamp *t)
+{
+	int i;
+
+	for (i = 0; i < SPANS; i++)
+		if (t->spans[i])
+			latency_stop(t->spans[i]);
+	free(t);
+}
@@ -0,0 +1,15 @@
+#ifndef TSTAMP_H
+#define TSTAMP_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+struct tstamp;
+
+struct tstamp *tstamp_start(int pullsock, int pushsock);
+ssize_t tstamp_recv(struct tstamp *t, char *buffer, size_t size);
+ssize_t tstamp_send(struct tstamp *t, char *data, size_t size);
+void tstamp_report(struct tstamp *t, FILE *output);
+void tstamp_stop(struct tstamp *t);
+
+#endif
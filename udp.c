@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include "c37.h"
+#include "quality.h"
+#include "udp.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* UDP ingest takes C37.118 frames from any number of PMUs on one socket,
+ * a batch of datagrams per system call.  Where the kernel supports UDP GRO
+ * a single buffer may hold a run of same-sized datagrams, which are split
+ * apart again here.  Every frame must fill its datagram exactly and pass
+ * its CRC.  Each PMU's frames go through a quality monitor, which infers
+ * loss, reordering and duplicates from the timestamps; duplicates are
+ * dropped.
+ */
+
+#define UDP_BATCH	32
+#define UDP_BUFFER	65536
+#define UDP_RCVBUF	(4 * 1024 * 1024)
+
+struct udp_pmu {
+	struct quality *quality;
+	struct quality_stats stats;
+};
+
+struct udp {
+	int sock;
+	int gro;
+	char *buffers;
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	char control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+	struct udp_pmu **pmus;
+	uint16_t *seen;
+	int nseen;
+	FILE *events;
+
+	unsigned long long batches;
+	unsigned long long datagrams;
+	unsigned long long frames;
+	unsigned long long badlength;
+	unsigned long long badcrc;
+};
+
+/* Binds to [address:]port, joining the group if the address is a
+ * multicast group.  Quality events go to the given file, if any.
+ */
+struct udp *udp_start(char *spec, FILE *events)
+{
+	struct udp *udp;
+	struct sockaddr_in self;
+	struct ip_mreq mreq;
+	char *port;
+	int size = UDP_RCVBUF;
+	int yes = 1;
+	int err;
+
+	memset(&self, 0, sizeof(self));
+	self.sin_family = AF_INET;
+	self.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	port = strrchr(spec, ':');
+	if (port) {
+		*port = '\0';
+		err = inet_aton(spec, &self.sin_addr);
+		*port++ = ':';
+		if (!err) {
+			errno = EINVAL;
+			return NULL;
+		}
+	} else {
+		port = spec;
+	}
+	if (atoi(port) <= 0 || atoi(port) > 0xFFFF) {
+		errno = EINVAL;
+		return NULL;
+	}
+	self.sin_port = htons(atoi(port));
+
+	udp = calloc(1, sizeof(*udp));
+	if (!udp)
+		return NULL;
+	udp->sock = -1;
+	udp->events = events;
+
+	udp->buffers = malloc(UDP_BATCH * UDP_BUFFER);
+	udp->pmus = calloc(0x10000, sizeof(*udp->pmus));
+	udp->seen = calloc(0x10000, sizeof(*udp->seen));
+	if (!udp->buffers || !udp->pmus || !udp->seen)
+		goto fail;
+
+	udp->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (udp->sock < 0)
+		goto fail;
+
+	setsockopt(udp->sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	setsockopt(udp->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (IN_MULTICAST(ntohl(self.sin_addr.s_addr))) {
+		mreq.imr_multiaddr = self.sin_addr;
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+		if (bind(udp->sock, (struct sockaddr *)&self,
+			 sizeof(self)) < 0)
+			goto fail;
+		if (setsockopt(udp->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			       &mreq, sizeof(mreq)) < 0)
+			goto fail;
+	} else if (bind(udp->sock, (struct sockaddr *)&self,
+			sizeof(self)) < 0) {
+		goto fail;
+	}
+
+#ifdef UDP_GRO
+	if (!setsockopt(udp->sock, IPPROTO_UDP, UDP_GRO, &yes, sizeof(yes)))
+		udp->gro = 1;
+#endif
+
+	return udp;
+
+fail:
+	err = errno;
+	udp_stop(udp);
+	errno = err;
+	return NULL;
+}
+
+int udp_socket(struct udp *udp)
+{
+	return udp->sock;
+}
+
+/* Returns 0 if the frame repeats one already seen from its PMU.
+ */
+static int track(struct udp *udp, char *frame, size_t size)
+{
+	struct udp_pmu *pmu;
+	c37_packet header;
+	char name[16];
+
+	parse_c37_header(&header, frame);
+	pmu = udp->pmus[header.id_code];
+	if (!pmu) {
+		pmu = calloc(1, sizeof(*pmu));
+		if (!pmu)
+			return 1;
+		snprintf(name, sizeof(name), "pmu %u", header.id_code);
+		pmu->quality = quality_start(name, udp->events, &pmu->stats);
+		if (!pmu->quality) {
+			free(pmu);
+			return 1;
+		}
+		udp->pmus[header.id_code] = pmu;
+		udp->seen[udp->nseen++] = header.id_code;
+	}
+
+	return quality_frame(pmu->quality, frame, size);
+}
+
+static int check_frame(struct udp *udp, char *frame, size_t size)
+{
+	if (c37_frame_size(frame, size) != (int)size) {
+		udp->badlength++;
+		return 0;
+	}
+
+	if (!c37_check_crc(frame, size)) {
+		udp->badcrc++;
+		return 0;
+	}
+
+	if (c37_is_data(frame) && !track(udp, frame, size))
+		return 0;
+
+	udp->frames++;
+	return 1;
+}
+
+/* Receives one batch of datagrams and delivers every good frame in it.
+ * Returns the number of datagrams received, 0 if none were waiting.
+ */
+int udp_receive(struct udp *udp, udp_deliver deliver, void *arg)
+{
+	struct msghdr *hdr;
+	struct cmsghdr *cmsg;
+	char *buffer;
+	size_t length;
+	size_t segment;
+	size_t offset;
+	size_t size;
+	int received = 0;
+	int n;
+	int i;
+
+	for (i = 0; i < UDP_BATCH; i++) {
+		udp->iovs[i].iov_base = &udp->buffers[i * UDP_BUFFER];
+		udp->iovs[i].iov_len = UDP_BUFFER;
+		hdr = &udp->msgs[i].msg_hdr;
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_iov = &udp->iovs[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_control = udp->control[i];
+		hdr->msg_controllen = sizeof(udp->control[i]);
+	}
+
+	n = recvmmsg(udp->sock, udp->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+	udp->batches++;
+
+	for (i = 0; i < n; i++) {
+		hdr = &udp->msgs[i].msg_hdr;
+		buffer = udp->iovs[i].iov_base;
+		length = udp->msgs[i].msg_len;
+		if (hdr->msg_flags & MSG_TRUNC) {
+			udp->datagrams++;
+			udp->badlength++;
+			continue;
+		}
+
+		segment = length;
+#ifdef UDP_GRO
+		for (cmsg = CMSG_FIRSTHDR(hdr); cmsg;
+		     cmsg = CMSG_NXTHDR(hdr, cmsg))
+			if (cmsg->cmsg_level == IPPROTO_UDP &&
+			    cmsg->cmsg_type == UDP_GRO)
+				segment = *(int *)CMSG_DATA(cmsg);
+#else
+		(void)cmsg;
+#endif
+		if (!segment)
+			segment = length;
+
+		for (offset = 0; offset < length; offset += size) {
+			size = length - offset < segment ?
+			    length - offset : segment;
+			udp->datagrams++;
+			received++;
+			if (!check_frame(udp, &buffer[offset], size))
+				continue;
+			if (deliver(arg, &buffer[offset], size) < 0)
+				return -1;
+		}
+	}
+
+	return received;
+}
+
+void udp_report(struct udp *udp, FILE *output)
+{
+	struct quality_stats total;
+	struct udp_pmu *pmu;
+	char name[16];
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < udp->nseen; i++)
+		quality_add(&total, &udp->pmus[udp->seen[i]]->stats);
+
+	fprintf(output, "udp: %llu datagrams in %llu batches%s, %llu frames, "
+		"%llu bad length, %llu bad CRC, %d PMUs, %llu lost, "
+		"%llu reordered, %llu duplicate\n", udp->datagrams,
+		udp->batches, udp->gro ? " with GRO" : "", udp->frames,
+		udp->badlength, udp->badcrc, udp->nseen, total.missing,
+		total.reordered, total.duplicate);
+
+	for (i = 0; i < udp->nseen; i++) {
+		pmu = udp->pmus[udp->seen[i]];
+		if (quality_problems(&pmu->stats)) {
+			snprintf(name, sizeof(name), "pmu %u", udp->seen[i]);
+			quality_report(&pmu->stats, name, output);
+		}
+	}
+}
+
+void udp_stop(struct udp *udp)
+{
+	int i;
+
+	if (udp->sock >= 0)
+		close(udp->sock);
+	for (i = 0; udp->pmus && i < udp->nseen; i++) {
+		quality_stop(udp->pmus[udp->seen[i]]->quality);
+		free(udp->pmus[udp->seen[i]]);
+	}
+	free(udp->seen);
+	free(udp->pmus);
+	free(udp->buffers);
+	free(udp);
+}
@@ -0,0 +1,16 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdio.h>
+
+struct udp;
+
+typedef int (*udp_deliver)(void *arg, char *frame, size_t size);
+
+struct udp *udp_start(char *spec, FILE *events);
+int udp_socket(struct udp *udp);
+int udp_receive(struct udp *udp, udp_deliver deliver, void *arg);
+void udp_report(struct udp *udp, FILE *output);
+void udp_stop(struct udp *udp);
+
+#endif
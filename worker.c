@@ -0,0 +1,1638 @@
+#define _GNU_SOURCE
+
+#include "analytics.h"
+#include "bufpool.h"
+#include "c37.h"
+#include "control.h"
+#include "decimate.h"
+#include "flight.h"
+#include "latency.h"
+#include "log.h"
+#include "mux.h"
+#include "quality.h"
+#include "recent.h"
+#include "shmring.h"
+#include "net.h"
+#include "shed.h"
+#include "worker.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Streams are sharded across worker threads by a hash of their source.
+ * Each worker runs its own epoll loop over the streams it owns, and owns
+ * their sockets, logs and counters outright, so the data path takes no
+ * locks.  Each worker reads into one buffer of its own; a stream keeps only
+ * a partial frame between reads, in a buffer borrowed from a shared pool
+ * through the worker's cache, so an idle stream holds no buffer at all.
+ * A stream changes hands only by message: the main thread asks its owner
+ * to give it up, and the owner passes it on through the new worker's
+ * queue.  Counters are written only by their owner and read by the main
+ * thread with relaxed atomics.
+ *
+ * With multiplexing, the streams a worker owns share one connection per
+ * sink, tagged by stream number.  A stream that moves is closed on its old
+ * worker's connection before it is opened on the new one.
+ *
+ * With a shedding policy, each stream with a connection of its own sends
+ * through a shedder, so a slow sink costs that stream frames rather than
+ * stalling the worker.
+ *
+ * Streams connect without blocking, so that a worker brings up all of its
+ * streams at once and a dead source costs no one else any time.  A stream
+ * is in its worker's epoll set for writing while it connects, and on the
+ * worker's waiting list, which times out connects and brings back failed
+ * streams after a jittered, doubling backoff, so that a fleet of streams
+ * failing together does not retry together.
+ */
+
+#define STREAM_BUFFER	65536
+#define MAX_EVENTS	64
+
+/* Rebalancing only kicks in once the busiest worker moves a quarter more
+ * than the idlest, and by at least this many bytes per round.
+ */
+#define REBALANCE_MIN	65536
+
+#define BACKOFF_MIN_MS	250
+#define BACKOFF_MAX_MS	30000
+
+enum {
+	CONNECT_NONE,
+	CONNECT_PENDING,
+	CONNECT_BACKOFF,
+};
+
+enum {
+	MESSAGE_ADOPT,
+	MESSAGE_MOVE,
+	MESSAGE_STOP,
+};
+
+/* Messages queue up under the worker's lock, and wake it through an
+ * eventfd, so that posting never blocks, however far behind the worker is.
+ */
+struct message {
+	struct message *next;
+	int type;
+	int target;
+	struct stream *stream;
+};
+
+/* Epoll events carry a stream or a sink connection, told apart by the kind
+ * each starts with, or NULL for the worker's messages.
+ */
+enum {
+	KIND_STREAM,
+	KIND_SINK,
+};
+
+struct stream {
+	int kind;
+	struct stream_spec spec;
+	uint32_t number;
+	int mux;
+	struct sockaddr_in pulladdr;
+	struct sockaddr_in pushaddr;
+	int pullsock;
+	int pushsock;
+	struct log *log;
+	struct decimator *decimator;
+	struct shedder *shedder;
+	struct shed_stats shed;
+	struct quality *quality;
+	struct quality_stats quality_stats;
+	struct shmring *ring;
+	struct analytics *analytics;
+	struct analytics_stats analytics_stats;
+	struct recent *recent;
+	struct stream *muxnext;
+	struct stream *muxprev;
+	int muxopen;
+	char *buffer;
+	size_t length;
+	int opened;
+	int done;
+	int moving;
+	unsigned long long bytes;
+	unsigned long long frames;
+
+	/* Connecting, by the owner.  The time to the first frame, since the
+	 * pool started, is read by the main thread.
+	 */
+	int connect;
+	int pulled;
+	int pushed;
+	int idsent;
+	int attempts;
+	long long deadline;
+	struct stream *waiting;
+	int listed;
+	unsigned long long firstframe;
+
+	/* The main thread's view, for rebalancing.
+	 */
+	int owner;
+	unsigned long long sampled;
+	unsigned long long load;
+};
+
+/* A worker's multiplexed connection to a sink, shared by all the streams
+ * it owns that go there, which are on its list from the time they start
+ * waiting for it.  It is in the epoll set while it connects.
+ */
+struct sinkconn {
+	int kind;
+	int index;
+	struct sockaddr_in addr;
+	int sock;
+	int up;
+	struct stream *streams;
+};
+
+struct worker {
+	struct workers *pool;
+	int index;
+	int cpu;
+	pthread_t thread;
+	int started;
+	int epfd;
+	int wake;
+	pthread_mutex_t lock;
+	struct message *messages;
+	struct message *last;
+	struct bufcache *cache;
+	char *buffer;
+	struct sinkconn **muxes;
+	int nmuxes;
+	int nstreams;
+	struct stream *waiting;
+	unsigned int seed;
+	unsigned long long bytes;
+	unsigned long long frames;
+
+	unsigned long long sampled;
+	unsigned long long load;
+};
+
+struct workers {
+	struct worker_options options;
+	struct worker *workers;
+	int count;
+	struct bufpool *buffers;
+	struct stream *streams;
+	int nstreams;
+	struct control *control;
+	struct recent **caches;
+	int ncaches;
+	int live;
+	unsigned long long moves;
+	long long started;
+};
+
+static void count(unsigned long long *counter, unsigned long long n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static unsigned long long sample(unsigned long long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static long long now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int post(struct worker *w, int type, int target, struct stream *s)
+{
+	struct message *msg;
+	uint64_t one = 1;
+
+	msg = malloc(sizeof(*msg));
+	if (!msg)
+		return -1;
+	msg->next = NULL;
+	msg->type = type;
+	msg->target = target;
+	msg->stream = s;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->last)
+		w->last->next = msg;
+	else
+		w->messages = msg;
+	w->last = msg;
+	pthread_mutex_unlock(&w->lock);
+
+	/* The counter only fills up if the worker is already due to wake.
+	 */
+	if (write(w->wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+/* Returns the worker's multiplexed connection to the given sink, starting
+ * to make it if need be.
+ */
+static int find_mux(struct worker *w, struct sockaddr_in *addr)
+{
+	struct epoll_event event;
+	struct sinkconn **muxes;
+	struct sinkconn *conn;
+	int unused = -1;
+	int i;
+
+	for (i = 0; i < w->nmuxes; i++) {
+		conn = w->muxes[i];
+		if (conn->sock < 0)
+			unused = i;
+		else if (conn->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+			 conn->addr.sin_port == addr->sin_port)
+			return i;
+	}
+
+	if (unused < 0) {
+		muxes = realloc(w->muxes, (w->nmuxes + 1) * sizeof(*muxes));
+		if (!muxes)
+			return -1;
+		w->muxes = muxes;
+		conn = calloc(1, sizeof(*conn));
+		if (!conn)
+			return -1;
+		conn->kind = KIND_SINK;
+		conn->index = w->nmuxes;
+		conn->sock = -1;
+		w->muxes[w->nmuxes++] = conn;
+		unused = conn->index;
+	}
+
+	conn = w->muxes[unused];
+	conn->addr = *addr;
+	conn->up = 0;
+	conn->sock = connect_nonblocking(addr, 0);
+	if (conn->sock < 0)
+		return -1;
+
+	event.events = EPOLLOUT;
+	event.data.ptr = conn;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, conn->sock, &event) < 0) {
+		close(conn->sock);
+		conn->sock = -1;
+		return -1;
+	}
+	return unused;
+}
+
+/* Puts a stream on the list of its sink's connection, which may still be
+ * on its way up.
+ */
+static int join_mux(struct worker *w, struct stream *s)
+{
+	struct sinkconn *conn;
+
+	s->mux = find_mux(w, &s->pushaddr);
+	if (s->mux < 0)
+		return -1;
+
+	conn = w->muxes[s->mux];
+	s->muxprev = NULL;
+	s->muxnext = conn->streams;
+	if (conn->streams)
+		conn->streams->muxprev = s;
+	conn->streams = s;
+	return 0;
+}
+
+static void fail_mux(struct worker *w, int index, int err);
+
+/* Closes a stream on its sink's connection, if it was opened there, and
+ * takes it off the connection's list.  A connection that a send fails on
+ * is no good to any of its streams; the others fail with it, while the
+ * one that found out is left to its caller.
+ */
+static void detach_mux(struct worker *w, struct stream *s)
+{
+	struct sinkconn *conn;
+	int index = s->mux;
+	int err = 0;
+
+	if (index < 0)
+		return;
+
+	conn = w->muxes[index];
+	if (s->muxopen && conn->sock >= 0 &&
+	    mux_send(conn->sock, s->number, MUX_CLOSE, NULL, 0) < 0)
+		err = errno;
+	if (s->muxprev)
+		s->muxprev->muxnext = s->muxnext;
+	else
+		conn->streams = s->muxnext;
+	if (s->muxnext)
+		s->muxnext->muxprev = s->muxprev;
+	s->muxnext = NULL;
+	s->muxprev = NULL;
+	s->muxopen = 0;
+	s->mux = -1;
+
+	if (err) {
+		fail_mux(w, index, err);
+		errno = err;
+	}
+}
+
+/* Gives up on a stream's connection to its sink after a send on it has
+ * failed, keeping errno.
+ */
+static void drop_mux(struct worker *w, struct stream *s)
+{
+	int index = s->mux;
+	int err = errno;
+
+	s->muxopen = 0;
+	detach_mux(w, s);
+	fail_mux(w, index, err);
+	errno = err;
+}
+
+static int attach_mux(struct worker *w, struct stream *s)
+{
+	char name[256];
+	int n;
+
+	n = snprintf(name, sizeof(name), "%s:%s:%s", s->spec.pullhost,
+		     s->spec.pullport, s->spec.id);
+	if (n >= (int)sizeof(name))
+		n = sizeof(name) - 1;
+	if (mux_send(w->muxes[s->mux]->sock, s->number, MUX_OPEN, name,
+		     n) < 0) {
+		drop_mux(w, s);
+		return -1;
+	}
+	s->muxopen = 1;
+	return 0;
+}
+
+static int send_stream(struct worker *w, struct stream *s, char *data,
+		       size_t size)
+{
+	if (s->shedder)
+		return shedder_send(s->shedder, w->cache, s->pushsock, data,
+				    size);
+	if (s->mux < 0)
+		return send_all(s->pushsock, data, size);
+	if (mux_send(w->muxes[s->mux]->sock, s->number, MUX_DATA, data,
+		     size) < 0) {
+		drop_mux(w, s);
+		return -1;
+	}
+	return 0;
+}
+
+static int open_stream(struct worker *w, struct stream *s)
+{
+	struct worker_options *options = &w->pool->options;
+	struct log *divert = NULL;
+	char name[256];
+	char *prefix;
+	size_t length;
+
+	if (options->logprefix) {
+		length = strlen(options->logprefix) + strlen(s->spec.id) + 9;
+		prefix = malloc(length);
+		if (!prefix)
+			return -1;
+		snprintf(prefix, length, "%s%s.", options->logprefix,
+			 s->spec.id);
+		s->log = log_start(prefix, options->logbytes,
+				   options->logcount);
+		if (s->log && options->shed && !strcmp(options->shed, "divert")) {
+			strcat(prefix, "divert.");
+			divert = log_start(prefix, options->logbytes,
+					   options->logcount);
+			if (!divert) {
+				free(prefix);
+				return -1;
+			}
+		}
+		free(prefix);
+		if (!s->log)
+			return -1;
+	}
+
+	if (options->shed) {
+		s->shedder = shedder_start(options->shed, options->shedbytes,
+					   divert, &s->shed);
+		if (!s->shedder) {
+			if (divert)
+				log_stop(divert);
+			return -1;
+		}
+	}
+
+	if (options->decimate) {
+		s->decimator = decimator_start(options->decimate);
+		if (!s->decimator)
+			return -1;
+	}
+
+	if (options->ring) {
+		snprintf(name, sizeof(name), "%s%s", options->ring, s->spec.id);
+		s->ring = shmring_start(name, options->ringbytes);
+		if (!s->ring)
+			return -1;
+	}
+
+	if (options->analytics) {
+		snprintf(name, sizeof(name), "%s:%s:%s", s->spec.pullhost,
+			 s->spec.pullport, s->spec.id);
+		s->analytics = analytics_start(options->analytics, name,
+					       options->events,
+					       &s->analytics_stats);
+		if (!s->analytics)
+			return -1;
+	}
+
+	if (options->quality) {
+		snprintf(name, sizeof(name), "%s:%s:%s", s->spec.pullhost,
+			 s->spec.pullport, s->spec.id);
+		s->quality = quality_start(name, options->events,
+					   &s->quality_stats);
+		if (!s->quality)
+			return -1;
+	}
+
+	s->opened = 1;
+	return 0;
+}
+
+/* Puts a stream on the worker's waiting list, once.  Streams that are no
+ * longer waiting come off it as the list is next walked.
+ */
+static void wait_stream(struct worker *w, struct stream *s)
+{
+	if (s->listed)
+		return;
+	s->waiting = w->waiting;
+	w->waiting = s;
+	s->listed = 1;
+}
+
+/* Takes a stream off the waiting list at once, before it leaves the
+ * worker.
+ */
+static void unwait_stream(struct worker *w, struct stream *s)
+{
+	struct stream **link;
+
+	if (!s->listed)
+		return;
+	for (link = &w->waiting; *link != s; link = &(*link)->waiting)
+		;
+	*link = s->waiting;
+	s->listed = 0;
+}
+
+static void close_stream(struct worker *w, struct stream *s, int err)
+{
+	char *out;
+	size_t size;
+
+	flight_record(FLIGHT_CLOSE, s->pullsock, err, 0);
+	if (err)
+		fprintf(stderr, "Stream %s from %s:%s: %s\n", s->spec.id,
+			s->spec.pullhost, s->spec.pullport, strerror(err));
+
+	/* A source that finished cleanly leaves a last window to average.
+	 */
+	if (s->decimator && !err) {
+		size = decimator_flush(s->decimator, &out);
+		if (size)
+			send_stream(w, s, out, size);
+	}
+
+	detach_mux(w, s);
+	if (s->pullsock >= 0) {
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, s->pullsock, NULL);
+		close(s->pullsock);
+	}
+	if (s->pushsock >= 0)
+		close(s->pushsock);
+	if (s->log)
+		log_stop(s->log);
+	if (s->decimator)
+		decimator_stop(s->decimator);
+	if (s->shedder)
+		shedder_stop(s->shedder, w->cache);
+	if (s->quality)
+		quality_stop(s->quality);
+	if (s->ring)
+		shmring_stop(s->ring);
+	if (s->analytics)
+		analytics_stop(s->analytics);
+	bufcache_put(w->cache, s->buffer);
+
+	s->pullsock = -1;
+	s->pushsock = -1;
+	s->log = NULL;
+	s->decimator = NULL;
+	s->shedder = NULL;
+	s->quality = NULL;
+	s->ring = NULL;
+	s->analytics = NULL;
+	s->buffer = NULL;
+	s->length = 0;
+	s->connect = CONNECT_NONE;
+
+	if (s->opened)
+		__atomic_store_n(&w->nstreams, w->nstreams - 1,
+				 __ATOMIC_RELAXED);
+	__atomic_store_n(&s->done, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&w->pool->live, 1, __ATOMIC_RELAXED);
+}
+
+/* Starts connecting to the stream's source and sink, or joins the
+ * connection to its sink that the worker already has or is making.  With
+ * TCP Fast Open, the stream id rides on the SYN to the source.
+ */
+static int start_connect(struct worker *w, struct stream *s)
+{
+	struct worker_options *options = &w->pool->options;
+	struct epoll_event event;
+	size_t length = strlen(s->spec.id);
+	ssize_t n;
+
+	s->pulled = 0;
+	s->pushed = 0;
+	s->idsent = 0;
+	s->connect = CONNECT_PENDING;
+	s->deadline = now_ms() + options->timeout;
+	wait_stream(w, s);
+
+	s->pullsock = connect_nonblocking(&s->pulladdr, 1);
+	if (s->pullsock < 0)
+		return -1;
+	flight_record(FLIGHT_CONNECT, s->pullsock, s->attempts, 0);
+	n = send(s->pullsock, s->spec.id, length, MSG_NOSIGNAL);
+	if (n == (ssize_t)length)
+		s->idsent = 1;
+	else if (n >= 0 || (errno != EINPROGRESS && errno != EAGAIN &&
+			    errno != ENOTCONN))
+		return -1;
+
+	event.events = EPOLLOUT;
+	event.data.ptr = s;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->pullsock, &event) < 0)
+		return -1;
+
+	if (options->mux) {
+		if (join_mux(w, s) < 0)
+			return -1;
+		s->pushed = w->muxes[s->mux]->up;
+	} else {
+		s->pushsock = connect_nonblocking(&s->pushaddr, 0);
+		if (s->pushsock < 0)
+			return -1;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->pushsock,
+			      &event) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Brings back a stream whose connect failed after a backoff, or gives up
+ * on it once it has had all its tries.
+ */
+static void retry_stream(struct worker *w, struct stream *s, int err)
+{
+	struct worker_options *options = &w->pool->options;
+	long long backoff = BACKOFF_MIN_MS;
+	long long delay;
+	int i;
+
+	detach_mux(w, s);
+	if (s->pullsock >= 0)
+		close(s->pullsock);
+	if (s->pushsock >= 0)
+		close(s->pushsock);
+	s->pullsock = -1;
+	s->pushsock = -1;
+
+	s->attempts++;
+	if (options->tries && s->attempts >= options->tries) {
+		close_stream(w, s, err);
+		return;
+	}
+
+	for (i = 1; i < s->attempts && backoff < BACKOFF_MAX_MS; i++)
+		backoff *= 2;
+	if (backoff > BACKOFF_MAX_MS)
+		backoff = BACKOFF_MAX_MS;
+	delay = backoff / 2 + rand_r(&w->seed) % (backoff / 2 + 1);
+
+	if (s->attempts == 1)
+		fprintf(stderr, "Stream %s from %s:%s: %s, retrying\n",
+			s->spec.id, s->spec.pullhost, s->spec.pullport,
+			strerror(err));
+	s->connect = CONNECT_BACKOFF;
+	s->deadline = now_ms() + delay;
+	wait_stream(w, s);
+}
+
+static int attach_stream(struct worker *w, struct stream *s);
+static int start_reading(struct worker *w, struct stream *s);
+
+/* Opens and attaches a stream once its source and sink are both up.  A
+ * stream that has been open all along, and only waited for its sink's
+ * connection on a new worker, goes straight back to reading.
+ */
+static void finish_connect(struct worker *w, struct stream *s)
+{
+	s->connect = CONNECT_NONE;
+	if (s->opened) {
+		start_reading(w, s);
+		return;
+	}
+	if (open_stream(w, s) < 0) {
+		close_stream(w, s, errno);
+		return;
+	}
+	attach_stream(w, s);
+}
+
+/* Gives up on a multiplexed connection, and on every stream waiting for
+ * it or using it: those still connecting try again, and those that were
+ * open close.
+ */
+static void fail_mux(struct worker *w, int index, int err)
+{
+	struct sinkconn *conn = w->muxes[index];
+	struct stream *s;
+
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+	close(conn->sock);
+	conn->sock = -1;
+	conn->up = 0;
+
+	while ((s = conn->streams)) {
+		detach_mux(w, s);
+		if (s->opened)
+			close_stream(w, s, err);
+		else
+			retry_stream(w, s, err);
+	}
+}
+
+/* Moves a multiplexed connection along, and with it the streams waiting
+ * for it.
+ */
+static void check_mux(struct worker *w, struct sinkconn *conn)
+{
+	struct stream *next;
+	struct stream *s;
+	int up;
+
+	if (conn->sock < 0 || conn->up)
+		return;
+
+	up = connect_finished(conn->sock);
+	if (up < 0) {
+		fail_mux(w, conn->index, errno);
+		return;
+	}
+	if (!up)
+		return;
+
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->sock, NULL);
+	conn->up = 1;
+
+	for (s = conn->streams; s && conn->sock >= 0; s = next) {
+		next = s->muxnext;
+		if (s->connect != CONNECT_PENDING || s->pushed)
+			continue;
+		s->pushed = 1;
+		if (s->pulled)
+			finish_connect(w, s);
+	}
+}
+
+/* Moves a connecting stream along.  Each connection comes out of the
+ * epoll set once it is up, and the stream is attached once both are.
+ */
+static int check_connect(struct worker *w, struct stream *s)
+{
+	int up;
+
+	if (!s->pulled) {
+		up = connect_finished(s->pullsock);
+		if (up < 0)
+			return -1;
+		if (up) {
+			if (!s->idsent &&
+			    send_all(s->pullsock, s->spec.id,
+				     strlen(s->spec.id)) < 0)
+				return -1;
+			epoll_ctl(w->epfd, EPOLL_CTL_DEL, s->pullsock, NULL);
+			s->pulled = 1;
+		}
+	}
+
+	if (!s->pushed && s->mux < 0) {
+		up = connect_finished(s->pushsock);
+		if (up < 0)
+			return -1;
+		if (up) {
+			epoll_ctl(w->epfd, EPOLL_CTL_DEL, s->pushsock, NULL);
+			s->pushed = 1;
+		}
+	}
+
+	if (!s->pulled || !s->pushed)
+		return 0;
+
+	finish_connect(w, s);
+	return 0;
+}
+
+/* Times out connects and restarts streams whose backoff is over.  Returns
+ * how long until the next deadline, for epoll_wait().
+ */
+static int check_waiting(struct worker *w)
+{
+	struct stream **link = &w->waiting;
+	struct stream *s;
+	long long now = now_ms();
+	long long next = -1;
+
+	while ((s = *link)) {
+		if (s->connect != CONNECT_NONE && s->deadline <= now) {
+			if (s->connect == CONNECT_PENDING && s->mux >= 0 &&
+			    !w->muxes[s->mux]->up)
+				fail_mux(w, s->mux, ETIMEDOUT);
+			else if (s->connect == CONNECT_PENDING)
+				retry_stream(w, s, ETIMEDOUT);
+			else if (start_connect(w, s) < 0)
+				retry_stream(w, s, errno);
+		}
+
+		if (s->connect == CONNECT_NONE) {
+			*link = s->waiting;
+			s->listed = 0;
+			continue;
+		}
+		if (next < 0 || s->deadline < next)
+			next = s->deadline;
+		link = &s->waiting;
+	}
+
+	if (next < 0)
+		return -1;
+	return next > now ? next - now : 0;
+}
+
+static int adopt_stream(struct worker *w, struct stream *s)
+{
+	if (!s->opened) {
+		if (start_connect(w, s) < 0)
+			retry_stream(w, s, errno);
+		return 0;
+	}
+	return attach_stream(w, s);
+}
+
+static int attach_stream(struct worker *w, struct stream *s)
+{
+	__atomic_store_n(&w->nstreams, w->nstreams + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->moving, 0, __ATOMIC_RELAXED);
+	return start_reading(w, s);
+}
+
+/* Starts reading an open stream.  One that came from another worker may
+ * first have to wait for this worker's connection to its sink, while its
+ * source's data waits in the socket.
+ */
+static int start_reading(struct worker *w, struct stream *s)
+{
+	struct worker_options *options = &w->pool->options;
+	struct epoll_event event;
+
+	if (options->mux) {
+		if (s->mux < 0 && join_mux(w, s) < 0) {
+			close_stream(w, s, errno);
+			return -1;
+		}
+		if (!w->muxes[s->mux]->up) {
+			s->pulled = 1;
+			s->pushed = 0;
+			s->connect = CONNECT_PENDING;
+			s->deadline = now_ms() + options->timeout;
+			wait_stream(w, s);
+			return 0;
+		}
+		if (attach_mux(w, s) < 0) {
+			close_stream(w, s, errno);
+			return -1;
+		}
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = s;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->pullsock, &event) < 0) {
+		close_stream(w, s, errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void release_stream(struct worker *w, struct stream *s, int target)
+{
+	if (s->done || !s->opened)
+		return;
+
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, s->pullsock, NULL);
+	detach_mux(w, s);
+	unwait_stream(w, s);
+	s->connect = CONNECT_NONE;
+	if (post(&w->pool->workers[target], MESSAGE_ADOPT, 0, s) < 0) {
+		close_stream(w, s, errno);
+		return;
+	}
+	__atomic_store_n(&w->nstreams, w->nstreams - 1, __ATOMIC_RELAXED);
+}
+
+/* Keeps a partial frame for the next read, in the smallest buffer that
+ * holds it.
+ */
+static int keep_partial(struct worker *w, struct stream *s, char *data,
+			size_t length)
+{
+	if (s->buffer && (!length || buffer_size(s->buffer) < length)) {
+		bufcache_put(w->cache, s->buffer);
+		s->buffer = NULL;
+	}
+	s->length = 0;
+	if (!length)
+		return 0;
+
+	if (!s->buffer) {
+		s->buffer = bufcache_get(w->cache, length);
+		if (!s->buffer)
+			return -1;
+	}
+	memcpy(s->buffer, data, length);
+	s->length = length;
+	return 0;
+}
+
+/* Forwards every complete frame received so far, keeping any partial
+ * frame for next time.  Returns 0 at end of stream.
+ */
+static int read_stream(struct worker *w, struct stream *s)
+{
+	unsigned long long frames = 0;
+	char *data = w->buffer;
+	ssize_t nr;
+	size_t length;
+	size_t n;
+	size_t size;
+	char *out;
+	int framesize;
+
+	if (!data) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (s->length)
+		memcpy(data, s->buffer, s->length);
+	nr = recv(s->pullsock, &data[s->length], STREAM_BUFFER - s->length, 0);
+	flight_record(FLIGHT_RECV, s->pullsock, nr < 0 ? -errno : nr, 0);
+	if (nr <= 0)
+		return nr;
+	length = s->length + nr;
+
+	for (n = 0; n < length; n += framesize, frames++) {
+		framesize = c37_frame_size(&data[n], length - n);
+		if (framesize < 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (framesize == 0 || (size_t)framesize > length - n)
+			break;
+
+		if (s->quality)
+			quality_frame(s->quality, &data[n], framesize);
+		if (s->analytics)
+			analytics_frame(s->analytics, &data[n], framesize);
+		if (s->recent)
+			recent_frame(s->recent, &data[n], framesize);
+
+		if (s->ring && shmring_publish(s->ring, &data[n],
+					       framesize) < 0)
+			return -1;
+
+		if (s->decimator) {
+			size = decimator_push(s->decimator, &data[n],
+					      framesize, &out);
+			if (size && send_stream(w, s, out, size) < 0)
+				return -1;
+		}
+	}
+
+	if (keep_partial(w, s, &data[n], length - n) < 0)
+		return -1;
+
+	if (n == 0)
+		return 1;
+
+	if (!s->firstframe) {
+		__atomic_store_n(&s->firstframe,
+				 now_ns() - w->pool->started + 1,
+				 __ATOMIC_RELAXED);
+		fprintf(stderr, "Stream %s from %s:%s: first frame after "
+			"%.3f s, %d retries\n", s->spec.id, s->spec.pullhost,
+			s->spec.pullport, s->firstframe / 1e9, s->attempts);
+	}
+
+	if (s->log) {
+		if (log_write(s->log, data, n) < n)
+			return -1;
+	}
+
+	if (!s->decimator && send_stream(w, s, data, n) < 0)
+		return -1;
+
+	count(&s->bytes, n);
+	count(&s->frames, frames);
+	count(&w->bytes, n);
+	count(&w->frames, frames);
+	return 1;
+}
+
+/* Handles every message queued so far, in order.  Returns 0 once told to
+ * stop.
+ */
+static int handle_messages(struct worker *w)
+{
+	struct message *msg;
+	struct message *next;
+	uint64_t pending;
+	int running = 1;
+
+	if (read(w->wake, &pending, sizeof(pending)) < 0 && errno != EAGAIN)
+		return 0;
+
+	pthread_mutex_lock(&w->lock);
+	msg = w->messages;
+	w->messages = w->last = NULL;
+	pthread_mutex_unlock(&w->lock);
+
+	for (; msg; msg = next) {
+		next = msg->next;
+		if (running) {
+			switch (msg->type) {
+			case MESSAGE_ADOPT:
+				adopt_stream(w, msg->stream);
+				break;
+			case MESSAGE_MOVE:
+				release_stream(w, msg->stream, msg->target);
+				break;
+			case MESSAGE_STOP:
+				running = 0;
+				break;
+			}
+		}
+		free(msg);
+	}
+
+	return running;
+}
+
+static void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event events[MAX_EVENTS];
+	struct stream *s;
+	char name[32];
+	uint64_t since;
+	cpu_set_t set;
+	int messages;
+	int running = 1;
+	int timeout;
+	int err;
+	int n;
+	int i;
+
+	if (w->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err)
+			fprintf(stderr, "Pinning worker %d to CPU %d: %s\n",
+				w->index, w->cpu, strerror(err));
+	}
+
+	/* Allocated after pinning, so it lands on the worker's NUMA node.
+	 * Without it, streams fail as they are read.
+	 */
+	w->buffer = malloc(STREAM_BUFFER);
+	snprintf(name, sizeof(name), "worker %d", w->index);
+	flight_thread(name);
+
+	while (running) {
+		timeout = w->waiting ? check_waiting(w) : -1;
+		since = flight_clock();
+		n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+		flight_record(FLIGHT_WAIT, w->epfd, n < 0 ? -errno : n, since);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		/* Messages go last, so no stream is read after it has been
+		 * handed to another worker.
+		 */
+		messages = 0;
+		for (i = 0; i < n; i++) {
+			s = events[i].data.ptr;
+			if (!s) {
+				messages = 1;
+				continue;
+			}
+			if (s->kind == KIND_SINK) {
+				check_mux(w, events[i].data.ptr);
+				continue;
+			}
+
+			if (s->connect == CONNECT_PENDING) {
+				if (check_connect(w, s) < 0)
+					retry_stream(w, s, errno);
+				continue;
+			}
+
+			/* A sink's connect may have finished in this batch
+			 * after its stream was attached.
+			 */
+			if (s->connect != CONNECT_NONE || s->done ||
+			    !(events[i].events & ~EPOLLOUT))
+				continue;
+
+			err = read_stream(w, s);
+			if (err <= 0)
+				close_stream(w, s, err < 0 ? errno : 0);
+		}
+
+		if (messages)
+			running = handle_messages(w);
+	}
+
+	for (i = 0; i < w->nmuxes; i++) {
+		if (w->muxes[i]->sock >= 0)
+			close(w->muxes[i]->sock);
+		free(w->muxes[i]);
+	}
+	free(w->muxes);
+	free(w->buffer);
+	return NULL;
+}
+
+static int parse_cpus(const char *spec, int **cpus)
+{
+	char path[64];
+	char list[4096];
+	const char *p;
+	char *end;
+	FILE *file;
+	long first;
+	long last;
+	int count = 0;
+	int *v;
+
+	/* A NUMA node stands for all of its CPUs.
+	 */
+	if (!strncmp(spec, "node", 4)) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/%s/cpulist", spec);
+		file = fopen(path, "r");
+		if (!file)
+			return -1;
+		if (!fgets(list, sizeof(list), file)) {
+			fclose(file);
+			errno = EINVAL;
+			return -1;
+		}
+		fclose(file);
+		list[strcspn(list, "\n")] = '\0';
+		spec = list;
+	}
+
+	*cpus = NULL;
+	for (p = spec; *p; p = end) {
+		if (*p == ',')
+			p++;
+		first = strtol(p, &end, 10);
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (end == p || first < 0 || last < first ||
+		    (*end && *end != ',')) {
+			free(*cpus);
+			errno = EINVAL;
+			return -1;
+		}
+
+		for (; first <= last; first++) {
+			v = realloc(*cpus, (count + 1) * sizeof(*v));
+			if (!v) {
+				free(*cpus);
+				return -1;
+			}
+			*cpus = v;
+			(*cpus)[count++] = first;
+		}
+	}
+
+	return count;
+}
+
+static unsigned int hash_stream(struct stream_spec *spec)
+{
+	unsigned int h = 2166136261u;
+	const char *fields[3];
+	const char *p;
+	int i;
+
+	fields[0] = spec->pullhost;
+	fields[1] = spec->pullport;
+	fields[2] = spec->id;
+	for (i = 0; i < 3; i++) {
+		for (p = fields[i]; *p; p++)
+			h = (h ^ (unsigned char)*p) * 16777619u;
+		h = (h ^ ':') * 16777619u;
+	}
+
+	/* FNV's low bits mix poorly, and the worker count may be small.
+	 */
+	h ^= h >> 16;
+	h *= 0x45d9f3bu;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Every live stream gets a cache of its recent frames for the control
+ * socket, kept for the life of the pool so that it outlasts moves and
+ * reconnections.  Only the stream's current owner writes it.
+ */
+static int start_control(struct workers *pool)
+{
+	struct stream *s;
+	char name[256];
+	int i;
+
+	pool->caches = calloc(pool->nstreams, sizeof(*pool->caches));
+	if (!pool->caches)
+		return -1;
+
+	for (i = 0; i < pool->nstreams; i++) {
+		s = &pool->streams[i];
+		if (s->done)
+			continue;
+		snprintf(name, sizeof(name), "%s:%s:%s", s->spec.pullhost,
+			 s->spec.pullport, s->spec.id);
+		s->recent = recent_start(name, pool->options.recent);
+		if (!s->recent)
+			return -1;
+		pool->caches[pool->ncaches++] = s->recent;
+	}
+
+	pool->control = control_start(pool->options.control, pool->caches,
+				      pool->ncaches);
+	return pool->control ? 0 : -1;
+}
+
+struct workers *workers_start(struct worker_options *options,
+			      struct stream_spec *specs, int nspecs)
+{
+	struct workers *pool;
+	struct worker *w;
+	struct stream *s;
+	struct epoll_event event;
+	struct resolver *resolver = NULL;
+	int *cpus = NULL;
+	int ncpus = 0;
+	int err;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->options = *options;
+	pool->count = options->count;
+	pool->nstreams = nspecs;
+	pool->workers = calloc(pool->count, sizeof(*pool->workers));
+	pool->streams = calloc(nspecs, sizeof(*pool->streams));
+	pool->buffers = bufpool_start();
+	resolver = resolver_start();
+	if (!pool->workers || !pool->streams || !pool->buffers || !resolver)
+		goto fail;
+
+	if (options->cpus) {
+		ncpus = parse_cpus(options->cpus, &cpus);
+		if (ncpus <= 0)
+			goto fail;
+	}
+
+	for (i = 0; i < pool->count; i++) {
+		w = &pool->workers[i];
+		w->pool = pool;
+		w->index = i;
+		w->cpu = ncpus ? cpus[i % ncpus] : -1;
+		w->epfd = -1;
+		w->wake = -1;
+		pthread_mutex_init(&w->lock, NULL);
+		w->seed = now_ns() ^ (i * 2654435761u);
+	}
+	free(cpus);
+	cpus = NULL;
+
+	for (i = 0; i < pool->count; i++) {
+		w = &pool->workers[i];
+		w->cache = bufcache_start(pool->buffers);
+		if (!w->cache)
+			goto fail;
+		w->epfd = epoll_create1(0);
+		if (w->epfd < 0)
+			goto fail;
+		w->wake = eventfd(0, EFD_NONBLOCK);
+		if (w->wake < 0)
+			goto fail;
+
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake, &event) < 0)
+			goto fail;
+	}
+
+	for (i = 0; i < nspecs; i++) {
+		s = &pool->streams[i];
+		s->spec = specs[i];
+		s->number = i;
+		s->mux = -1;
+		s->pullsock = -1;
+		s->pushsock = -1;
+		s->owner = hash_stream(&s->spec) % pool->count;
+
+		err = resolver_lookup(resolver, &s->pulladdr,
+				      s->spec.pullhost, s->spec.pullport);
+		if (!err)
+			err = resolver_lookup(resolver, &s->pushaddr,
+					      s->spec.pushhost,
+					      s->spec.pushport);
+		if (err) {
+			fprintf(stderr, "Stream %s: %s\n", s->spec.id,
+				gai_strerror(err));
+			s->done = 1;
+			continue;
+		}
+		pool->live++;
+	}
+	resolver_stop(resolver);
+	resolver = NULL;
+
+	if (options->control && start_control(pool) < 0)
+		goto fail;
+
+	for (i = 0; i < pool->count; i++) {
+		w = &pool->workers[i];
+		err = pthread_create(&w->thread, NULL, run_worker, w);
+		if (err) {
+			errno = err;
+			goto fail;
+		}
+		w->started = 1;
+	}
+
+	pool->started = now_ns();
+	for (i = 0; i < nspecs; i++) {
+		s = &pool->streams[i];
+		if (!s->done &&
+		    post(&pool->workers[s->owner], MESSAGE_ADOPT, 0, s) < 0)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	err = errno;
+	free(cpus);
+	if (resolver)
+		resolver_stop(resolver);
+	workers_stop(pool);
+	errno = err;
+	return NULL;
+}
+
+int workers_running(struct workers *pool)
+{
+	return __atomic_load_n(&pool->live, __ATOMIC_RELAXED) > 0;
+}
+
+/* Moves one stream from the busiest worker to the idlest, choosing the
+ * stream that best evens out their load over the last round.  Returns 1
+ * if a stream was moved.
+ */
+int workers_rebalance(struct workers *pool)
+{
+	struct worker *hot = NULL;
+	struct worker *cold = NULL;
+	struct worker *w;
+	struct stream *best = NULL;
+	struct stream *s;
+	unsigned long long gap;
+	unsigned long long bytes;
+	unsigned long long distance;
+	unsigned long long bestdistance = 0;
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		w = &pool->workers[i];
+		bytes = sample(&w->bytes);
+		w->load = bytes - w->sampled;
+		w->sampled = bytes;
+		if (!hot || w->load > hot->load)
+			hot = w;
+		if (!cold || w->load < cold->load)
+			cold = w;
+	}
+
+	for (i = 0; i < pool->nstreams; i++) {
+		s = &pool->streams[i];
+		bytes = sample(&s->bytes);
+		s->load = bytes - s->sampled;
+		s->sampled = bytes;
+	}
+
+	gap = hot->load - cold->load;
+	if (hot == cold || gap < REBALANCE_MIN ||
+	    hot->load < cold->load + cold->load / 4)
+		return 0;
+
+	for (i = 0; i < pool->nstreams; i++) {
+		s = &pool->streams[i];
+		if (s->owner != hot->index || !s->load || s->load >= gap ||
+		    __atomic_load_n(&s->done, __ATOMIC_RELAXED) ||
+		    __atomic_load_n(&s->moving, __ATOMIC_RELAXED))
+			continue;
+
+		distance = s->load > gap / 2 ? s->load - gap / 2 :
+		    gap / 2 - s->load;
+		if (!best || distance < bestdistance) {
+			best = s;
+			bestdistance = distance;
+		}
+	}
+
+	if (!best)
+		return 0;
+
+	__atomic_store_n(&best->moving, 1, __ATOMIC_RELAXED);
+	if (post(hot, MESSAGE_MOVE, cold->index, best) < 0) {
+		__atomic_store_n(&best->moving, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	best->owner = cold->index;
+	pool->moves++;
+	return 1;
+}
+
+static void report_shedding(struct workers *pool, FILE *output)
+{
+	struct shed_stats total;
+	struct shed_stats *stats;
+	unsigned long long maxqueue;
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < pool->nstreams; i++) {
+		stats = &pool->streams[i].shed;
+		total.shedding += __atomic_load_n(&stats->shedding,
+						  __ATOMIC_RELAXED);
+		total.episodes += sample(&stats->episodes);
+		total.dropped += sample(&stats->dropped);
+		total.thinned += sample(&stats->thinned);
+		total.diverted += sample(&stats->diverted);
+		total.deferred += sample(&stats->deferred);
+		maxqueue = sample(&stats->maxqueue);
+		if (maxqueue > total.maxqueue)
+			total.maxqueue = maxqueue;
+	}
+
+	fprintf(output, "shedding: %d streams now, %llu episodes, %llu frames "
+		"deferred, %llu dropped, %llu thinned, %llu diverted, "
+		"deepest sink queue %llu bytes\n", total.shedding,
+		total.episodes, total.deferred, total.dropped, total.thinned,
+		total.diverted, total.maxqueue);
+}
+
+/* Totals every stream, then lists those that have had problems.
+ */
+static void report_quality(struct workers *pool, FILE *output)
+{
+	struct quality_stats total;
+	struct stream *s;
+	char name[256];
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < pool->nstreams; i++)
+		quality_add(&total, &pool->streams[i].quality_stats);
+	quality_report(&total, "all streams", output);
+
+	for (i = 0; i < pool->nstreams; i++) {
+		s = &pool->streams[i];
+		if (!quality_problems(&s->quality_stats))
+			continue;
+		snprintf(name, sizeof(name), "%s:%s:%s", s->spec.pullhost,
+			 s->spec.pullport, s->spec.id);
+		quality_report(&s->quality_stats, name, output);
+	}
+}
+
+/* Totals every stream, then lists those with alarms raised now.
+ */
+static void report_analytics(struct workers *pool, FILE *output)
+{
+	struct analytics_stats total;
+	struct stream *s;
+	char name[256];
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < pool->nstreams; i++)
+		analytics_add(&total, &pool->streams[i].analytics_stats);
+	analytics_report(&total, "all streams", output);
+
+	for (i = 0; i < pool->nstreams; i++) {
+		s = &pool->streams[i];
+		if (!__atomic_load_n(&s->analytics_stats.active,
+				     __ATOMIC_RELAXED))
+			continue;
+		snprintf(name, sizeof(name), "%s:%s:%s", s->spec.pullhost,
+			 s->spec.pullport, s->spec.id);
+		analytics_report(&s->analytics_stats, name, output);
+	}
+}
+
+/* How long streams took to deliver their first frame since the pool
+ * started.
+ */
+static void report_startup(struct workers *pool, FILE *output)
+{
+	struct latency *startup;
+	unsigned long long first;
+	int heard = 0;
+	int i;
+
+	startup = latency_start();
+	if (!startup)
+		return;
+
+	for (i = 0; i < pool->nstreams; i++) {
+		first = sample(&pool->streams[i].firstframe);
+		if (first) {
+			latency_add(startup, first - 1);
+			heard++;
+		}
+	}
+
+	fprintf(output, "startup: %d of %d streams have sent a frame\n",
+		heard, pool->nstreams);
+	if (heard)
+		latency_report(startup, "time to first frame", output);
+	latency_stop(startup);
+}
+
+void workers_report(struct workers *pool, FILE *output)
+{
+	struct worker *w;
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		w = &pool->workers[i];
+		fprintf(output, "worker %d: cpu %d, %d streams, %llu frames, "
+			"%llu bytes\n", i, w->cpu,
+			__atomic_load_n(&w->nstreams, __ATOMIC_RELAXED),
+			sample(&w->frames), sample(&w->bytes));
+	}
+	bufpool_report(pool->buffers, output);
+	if (pool->options.shed)
+		report_shedding(pool, output);
+	if (pool->options.quality)
+		report_quality(pool, output);
+	if (pool->options.analytics)
+		report_analytics(pool, output);
+	report_startup(pool, output);
+
+	fprintf(output, "workers: %d of %d streams live, %llu moves\n",
+		__atomic_load_n(&pool->live, __ATOMIC_RELAXED),
+		pool->nstreams, pool->moves);
+	fflush(output);
+}
+
+void workers_stop(struct workers *pool)
+{
+	struct message *msg;
+	struct worker *w;
+	struct stream *s;
+	int i;
+
+	if (pool->control)
+		control_stop(pool->control);
+
+	for (i = 0; pool->workers && i < pool->count; i++) {
+		w = &pool->workers[i];
+		if (w->started) {
+			post(w, MESSAGE_STOP, 0, NULL);
+			pthread_join(w->thread, NULL);
+		}
+	}
+
+	for (i = 0; pool->streams && i < pool->nstreams; i++) {
+		s = &pool->streams[i];
+		if (s->done)
+			continue;
+		if (s->pullsock >= 0)
+			close(s->pullsock);
+		if (s->pushsock >= 0)
+			close(s->pushsock);
+		if (s->log)
+			log_stop(s->log);
+		if (s->decimator)
+			decimator_stop(s->decimator);
+		if (s->shedder)
+			shedder_stop(s->shedder, pool->workers[s->owner].cache);
+		if (s->quality)
+			quality_stop(s->quality);
+		if (s->ring)
+			shmring_stop(s->ring);
+		if (s->analytics)
+			analytics_stop(s->analytics);
+		if (s->buffer)
+			bufcache_put(pool->workers[s->owner].cache, s->buffer);
+	}
+
+	for (i = 0; pool->workers && i < pool->count; i++) {
+		w = &pool->workers[i];
+		if (w->cache)
+			bufcache_stop(w->cache);
+		if (w->epfd >= 0)
+			close(w->epfd);
+		if (w->wake >= 0)
+			close(w->wake);
+		while (w->messages) {
+			msg = w->messages;
+			w->messages = msg->next;
+			free(msg);
+		}
+		if (w->pool)
+			pthread_mutex_destroy(&w->lock);
+	}
+
+	for (i = 0; i < pool->ncaches; i++)
+		recent_stop(pool->caches[i]);
+	free(pool->caches);
+
+	if (pool->buffers)
+		bufpool_stop(pool->buffers);
+	free(pool->streams);
+	free(pool->workers);
+	free(pool);
+}
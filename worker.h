@@ -0,0 +1,44 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdio.h>
+
+struct stream_spec {
+	char *pullhost;
+	char *pullport;
+	char *id;
+	char *pushhost;
+	char *pushport;
+};
+
+struct worker_options {
+	int count;
+	char *cpus;
+	char *logprefix;
+	size_t logbytes;
+	size_t logcount;
+	char *decimate;
+	int mux;
+	char *shed;
+	size_t shedbytes;
+	int quality;
+	FILE *events;
+	char *ring;
+	size_t ringbytes;
+	char *analytics;
+	char *control;
+	size_t recent;
+	int tries;
+	int timeout;
+};
+
+struct workers;
+
+struct workers *workers_start(struct worker_options *options,
+			      struct stream_spec *specs, int nspecs);
+int workers_running(struct workers *pool);
+int workers_rebalance(struct workers *pool);
+void workers_report(struct workers *pool, FILE *output);
+void workers_stop(struct workers *pool);
+
+#endif